@@ -7,11 +7,17 @@
 // Still under heavy development.  API in a state of flux.
 
 #include <inttypes.h>
+#include <stddef.h>
 
- // I can't guarantee values larger than this won't cause overflow somewhere
+ // The default output rate.  Each player can have its own, see
+ //  mdv_set_sample_rate.
 #define MDV_SAMPLE_RATE 48000
+#define MDV_MIN_SAMPLE_RATE 8000
+#define MDV_MAX_SAMPLE_RATE 192000
 
 typedef struct MDV_Sequence MDV_Sequence;
+typedef struct MDV_Stream MDV_Stream;
+typedef struct MDV_Timed_Event MDV_Timed_Event;
 typedef struct MDV_Player MDV_Player;
 typedef struct MDV_Event MDV_Event;
 typedef struct MDV_Patch MDV_Patch;
@@ -23,36 +29,170 @@ typedef struct MDV_Sample MDV_Sample;
 MDV_Player* mdv_new_player ();
 
  // Load a .cfg containing patch names (nothing complicated please)
+ //  This is the same as loading a patch library, using it, and freeing it.
 void mdv_load_config (MDV_Player*, const char* filename);
 
  // Set the sequence currently being played (use load_midi)
 void mdv_play_sequence (MDV_Player*, MDV_Sequence*);
+ // Or play from a stream.  The player reads it as it goes, so don't touch it
+ //  until the player is done with it.
+void mdv_play_stream (MDV_Player*, MDV_Stream*);
 
  // Just do a single event.
 void mdv_play_event (MDV_Player*, MDV_Event*);
 
+ // Live input.  One thread can queue events while another renders audio,
+ //  without either waiting on the other.  Each event plays exactly at the
+ //  given sample, even in the middle of an mdv_get_audio call.  Queue events
+ //  in time order; one that's late plays at the start of the next call.
+ //  The player keeps rendering while there are events queued or notes
+ //  playing, even if there's no sequence.  Returns 0 if the queue is full.
+ //  Only one thread at a time may queue events.
+#define MDV_EVENT_QUEUE_SIZE 1024
+int mdv_queue_event (MDV_Player*, uint64_t sample, const MDV_Event*);
+ // The sample the next mdv_get_audio call starts at, for timing queued
+ //  events.  Safe to call from any thread.
+uint64_t mdv_get_clock (MDV_Player*);
+
  // Get this many bytes of audio.  len must be a multiple of 4
 void mdv_get_audio (MDV_Player*, uint8_t* buf, int len);
 
+ // Stems are separate outputs for groups of channels, all rendered in the
+ //  same pass.  By default each channel is its own stem, numbered the same.
+#define MDV_MAX_STEMS 16
+void mdv_channel_set_stem (MDV_Player*, uint8_t channel, uint8_t stem);
+ // Like mdv_get_audio, but also puts each stem's audio in stems[stem], which
+ //  are all len bytes.  Stems past n_stems or with a NULL buffer aren't
+ //  rendered separately.  master gets everything, like mdv_get_audio, and
+ //  can be NULL if you only want the stems.  Each output is clipped on its
+ //  own, so stems add up to master unless something clips, or there's
+ //  reverb or chorus, which only go to master.
+void mdv_get_stem_audio (MDV_Player*, uint8_t* master, uint8_t** stems, int n_stems, int len);
+
+ // Render a whole sequence offline, on this many threads, as fast as possible.
+ //  The result is identical to calling mdv_play_sequence and then
+ //  mdv_get_audio until playback finishes, but the player itself is left
+ //  untouched.  Returns a malloced buffer, and sets len to its size in bytes.
+uint8_t* mdv_render_sequence (MDV_Player*, MDV_Sequence*, int n_threads, size_t* len);
+
  // 0 if either no sequence was given or the sequence is done
 int mdv_currently_playing (MDV_Player*);
 
  // Delete a player
 void mdv_free_player (MDV_Player*);
 
+ // Output this many frames per second, clamped to between
+ //  MDV_MIN_SAMPLE_RATE and MDV_MAX_SAMPLE_RATE.  Patches don't depend on
+ //  the rate, so any number of players at different rates can share them.
+ //  Changing the rate cuts off any notes playing, and keeps the position in
+ //  the song.
+void mdv_set_sample_rate (MDV_Player*, uint32_t rate);
+uint32_t mdv_get_sample_rate (MDV_Player*);
+
+ // Mix voices on this many threads (including the calling one).  The output
+ //  doesn't depend on the thread count, it's just faster with lots of voices.
+ //  Default is 1, which doesn't start any threads.
+void mdv_set_threads (MDV_Player*, int n_threads);
+
+ // How voices interpolate between the frames of their samples.  Cubic
+ //  costs little more than linear and aliases much less when notes are
+ //  pitched away from their samples.  Sinc (16 taps) is the cleanest and
+ //  costs the most.
+enum MDV_Interpolation {
+    MDV_LINEAR,  // Default
+    MDV_CUBIC,
+    MDV_SINC
+};
+void mdv_set_interpolation (MDV_Player*, int interpolation);
+
+ // Reverb and chorus, fed by each channel's MDV_REVERB and MDV_CHORUS
+ //  controllers (both 0 until a song sets them).  Their output only goes to
+ //  the master, not to stems.  On by default.
+void mdv_set_effects (MDV_Player*, int enabled);
+
+ // Running totals for profiling and monitoring, since the player was made or
+ //  the counters were last reset.  They're updated once per chunk (at most
+ //  512 frames), and are only for the player's own audio: mdv_render_sequence
+ //  works on a copy and leaves them alone.  Build the library with
+ //  -DMDV_NO_COUNTERS (perl make.pl --counters=off) to leave them out, and
+ //  they stay 0.
+enum MDV_Stage {
+    MDV_STAGE_EVENTS,  // Playing events and setting up chunks
+    MDV_STAGE_CONTROL,  // Envelopes, LFOs and pitch
+    MDV_STAGE_MIX,  // Mixing voices and collecting effect sends
+    MDV_STAGE_EFFECTS,  // Reverb and chorus
+    MDV_STAGE_OUTPUT,  // Summing, clipping and converting to 16 bits
+    MDV_N_STAGES
+};
+typedef struct MDV_Counters {
+    uint64_t blocks;  // Chunks rendered, split at events and every 512 frames
+    uint64_t voice_samples;  // Frames mixed times voices playing
+    uint64_t control_updates;  // Per voice, every 32 frames and on note-on
+    uint64_t events;  // Played from the sequence or stream and the queue
+    uint64_t dropped_notes;  // For lack of a voice that could be stolen
+    uint64_t clipped_samples;  // In the master output, counting each side
+    uint32_t peak;  // Largest absolute master sample before clipping
+    uint32_t max_active_voices;  // Including stolen ones fading out
+     // Wall time on the thread calling mdv_get_audio, in nanoseconds.
+     //  Control updates are timed one block in eight and scaled up, since
+     //  timing every one would cost more than the updates.
+    uint64_t stage_ns [MDV_N_STAGES];
+} MDV_Counters;
+void mdv_get_counters (MDV_Player*, MDV_Counters*);
+void mdv_reset_counters (MDV_Player*);
+
+ // Play at most this many notes at once (up to 255, default 240).  Past
+ //  that, a new note steals a voice: a released one if there is one, then
+ //  the quietest, then the oldest.  Stolen voices fade out over a few
+ //  milliseconds in one of the voices left over.
+void mdv_set_polyphony (MDV_Player*, int voices);
+ // Play at most this many notes at once on one channel.  Past that, the
+ //  channel steals from itself.  Default 255.
+void mdv_channel_set_polyphony (MDV_Player*, uint8_t channel, int voices);
+ // Don't let other channels steal from this one while it has this many
+ //  notes or fewer.  Default 0.
+void mdv_channel_reserve_voices (MDV_Player*, uint8_t channel, int voices);
+
 void mdv_channel_set_drums (MDV_Player*, uint8_t channel, int is_drums);
 int mdv_channel_is_drums (MDV_Player*, uint8_t channel);
 void mdv_fast_forward_to_note (MDV_Player*);
 
+ // Jump to this many samples from the start of the sequence or stream.  Notes
+ //  that started before then aren't heard.  The first seek in a sequence builds
+ //  an index of checkpoints, after which seeking only replays the events
+ //  since the nearest one.  Streams have no index and replay from the start.
+void mdv_seek (MDV_Player*, uint64_t sample);
+
 
 ///// Main sequences API /////
 
 MDV_Sequence* mdv_load_midi (const char* filename);
+ // Decode the file's tracks on up to this many threads.  The result is the
+ //  same either way; events on the same tick stay in track order.
+MDV_Sequence* mdv_load_midi_threaded (const char* filename, int n_threads);
 
 void mdv_free_sequence (MDV_Sequence*);
 
 void mdv_print_sequence (MDV_Sequence*);
 
+ // A stream decodes a MIDI file as it's played instead of all at once, so it
+ //  can start right away and uses the same memory for any length of file.
+ // Like pread: read len bytes at offset into buf, returning how many were read.
+typedef size_t MDV_Read_Func (void* data, uint64_t offset, void* buf, size_t len);
+
+ // Map the file and stream from it
+MDV_Stream* mdv_open_midi_stream (const char* filename);
+MDV_Stream* mdv_new_midi_stream (MDV_Read_Func*, void* data);
+ // The next event, or NULL at the end of the stream
+const MDV_Timed_Event* mdv_stream_peek (MDV_Stream*);
+ // When the next event happens, in the same units as MDV_Sequence's times
+uint64_t mdv_stream_time (MDV_Stream*);
+void mdv_stream_next (MDV_Stream*);
+ // Go back to the beginning
+void mdv_rewind_stream (MDV_Stream*);
+uint32_t mdv_stream_tpb (MDV_Stream*);
+void mdv_free_stream (MDV_Stream*);
+
 
 ///// Events API /////
 // U = unimplemented
@@ -105,8 +245,8 @@ enum MDV_Controller {
     MDV_HOLD_2 = 69,  // U
     MDV_RELEASE_TIME = 72,  // U
     MDV_ATTACK_TIME = 73,  // U
-    MDV_REVERB = 91,  // U
-    MDV_CHORUS = 93,  // U
+    MDV_REVERB = 91,
+    MDV_CHORUS = 93,
     MDV_NRPN_LSB = 98,  // U
     MDV_NRPN_MSB = 99,  // U
     MDV_RPN_LSB = 100,
@@ -149,38 +289,55 @@ typedef struct MDV_Sequence {
     uint32_t tpb;
     uint32_t n_events;
     MDV_Timed_Event* events;
+     // When each event happens, with tempo changes applied.  In microseconds
+     //  from the start, 44:20 fixed point.
+    uint64_t* times;
 } MDV_Sequence;
 
 
 ///// Patches API /////
 
+ // Sample data can be read this many frames past either end, so
+ //  interpolation doesn't need bounds checks.
+#define MDV_SAMPLE_GUARD 32
+
+ // Samples are prepared when loaded, so they always play forward.  Reversed
+ //  samples are flipped, and ping-pong loops are unrolled into forward loops.
+ //  Anything after the loop is never played, so the data ends with the loop
+ //  carried on, and the loop is placed MDV_SAMPLE_GUARD frames into that.
+ //  Interpolation reads the same frames on either side of the loop's start
+ //  as its end.
 typedef struct MDV_Sample {
      // in 16:16 Hz
     uint32_t low_freq;
     uint32_t high_freq;
     uint32_t root_freq;
+     // The rate the sample was recorded at, in Hz
+    uint32_t sample_rate;
      // 32:32 in samples
     int64_t loop_start;
     int64_t loop_end;
+     // Nothing here depends on the output rate.  Players work out the
+     //  per-sample increments for their own rate when a note starts.
+     // In TiMidity's units, which are per sample at 44100 Hz
     uint32_t envelope_rates [6];
     uint32_t envelope_offsets [6];
-     // 8:24 fixed point, I think
-    int32_t tremolo_sweep_inc;
-    int32_t tremolo_phase_inc;
-    int32_t vibrato_sweep_inc;
-    int32_t vibrato_phase_inc;
+     // As they are in the .pat
+    uint8_t tremolo_sweep;
+    uint8_t tremolo_rate;
+    uint8_t vibrato_sweep;
+    uint8_t vibrato_rate;
     int16_t tremolo_depth;
     int16_t vibrato_depth;
 
     uint8_t pan;
     uint8_t loop;
-    uint8_t pingpong;
+    uint8_t pingpong;  // Already unrolled, so just for information
     uint8_t sustain;
     uint16_t scale_note;  // TODO: this doesn't need to be 16, does it?
     uint16_t scale_factor;
-     // 32:32
-    int64_t sample_inc;
     uint32_t data_size;
+     // Aligned to 64 bytes, with MDV_SAMPLE_GUARD frames on each side
     int16_t* data;
 } MDV_Sample;
 
@@ -191,13 +348,72 @@ typedef struct MDV_Patch {
     uint8_t n_samples;
     uint8_t keep_loop;
     uint8_t keep_envelope;
+     // Set on patches mapped from a bank file, which aren't freed on their
+     //  own, and on the patch that owns the mapping as its block.
+    uint8_t mapped;
+     // Patches are shared and immutable once loaded, so they're refcounted.
+    uint32_t refs;
+     // If not NULL, samples belong to this patch, and we hold a reference on it
+    MDV_Patch* source;
+     // For the patch that owns a mapped bank file, the mapping
+    void* block;
+    size_t block_size;
     MDV_Sample* samples;
+     // Which sample plays each note
+    uint8_t note_samples [128];
 } MDV_Patch;
 
+ // Load a .pat file, returning a patch with one reference
 MDV_Patch* mdv_patch_load (const char* filename);
+ // Add a reference to a patch.  Returns the patch.
+MDV_Patch* mdv_patch_ref (MDV_Patch*);
+ // Make a patch with its own settings (volume, note, keep_*) that shares
+ //  the given patch's samples.  Returns it with one reference.
+MDV_Patch* mdv_patch_variant (MDV_Patch*);
+ // Drop a reference to a patch, freeing it when there are none left.
 void mdv_patch_free (MDV_Patch*);
 void mdv_patch_print (MDV_Patch*);
+ // These take over one reference to the patch.
 void mdv_set_patch (MDV_Player*, uint8_t bank, uint8_t program, MDV_Patch*);
 void mdv_set_drum (MDV_Player*, uint8_t bank, uint8_t program, MDV_Patch*);
 
+///// Patch library API /////
+// A patch library holds all the patches from a .cfg.  Each .pat file is
+//  loaded once no matter how many times the .cfg mentions it, and players
+//  using the library share its patches instead of copying them.
+
+typedef struct MDV_Patch_Library MDV_Patch_Library;
+
+ // Reads the .cfg and loads every patch in it.
+MDV_Patch_Library* mdv_load_patch_library (const char* cfg);
+ // Only reads the .cfg.  Patches are loaded on a background thread the first
+ //  time a program change or drum note asks for them; notes that arrive
+ //  before their patch is loaded are dropped, so playback never waits on a
+ //  file.  Prefetch the sequence to avoid that.
+MDV_Patch_Library* mdv_index_patch_library (const char* cfg);
+ // Returns NULL if the library doesn't have the patch.  If it has it but it
+ //  isn't loaded yet, this requests it, returns NULL, and sets *pending.
+MDV_Patch* mdv_library_patch (MDV_Patch_Library*, int drumset, uint8_t bank, uint8_t program, int* pending);
+ // Request every patch the sequence will use.  mdv_play_sequence does this
+ //  for the player's library.
+void mdv_prefetch_sequence (MDV_Patch_Library*, MDV_Sequence*);
+ // Block until all requested patches are loaded.
+void mdv_wait_patch_library (MDV_Patch_Library*);
+ // The player keeps a reference to the library, and takes patches from it
+ //  that weren't set with mdv_set_patch or mdv_set_drum.
+void mdv_use_patch_library (MDV_Player*, MDV_Patch_Library*);
+MDV_Patch_Library* mdv_patch_library_ref (MDV_Patch_Library*);
+ // Drop a reference to the library, freeing it when there are none left.
+void mdv_free_patch_library (MDV_Patch_Library*);
+
+ // A bank file is a .cfg and all its patches compiled into one file, which
+ //  can be mapped straight into memory.  Returns 0 on failure.
+int mdv_compile_patch_bank (const char* cfg, const char* bank);
+ // Returns NULL if the bank can't be used, including if any of the files it
+ //  was compiled from have changed since.
+MDV_Patch_Library* mdv_load_patch_bank (const char* bank);
+ // Loads the bank, compiling it first if it's missing or out of date.  If it
+ //  can't be written, this just loads the .cfg.
+MDV_Patch_Library* mdv_load_cached_patch_library (const char* cfg, const char* bank);
+
 #endif
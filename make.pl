@@ -6,18 +6,28 @@ $ENV{CC} //= 'gcc';
 
 my %config = (
     build => undef,
+    counters => undef,
 );
 config('build-config', \%config, sub {
     if (!defined($config{build})) {
         print "build-config: setting --build=release\n";
         $config{build} = 'release';
     }
+    if (!defined($config{counters})) {
+        print "build-config: setting --counters=on\n";
+        $config{counters} = 'on';
+    }
 });
 option 'build', sub {
     $_[0] eq 'release' or $_[0] eq 'debug'
         or die "Unsupported build type.  Recognized are: release debug\n";
     $config{build} = $_[0];
 }, '--build=[release|debug] - Select build type (current: ' . ($config{build} // 'release') . ')';
+option 'counters', sub {
+    $_[0] eq 'on' or $_[0] eq 'off'
+        or die "Unsupported counters setting.  Recognized are: on off\n";
+    $config{counters} = $_[0];
+}, '--counters=[on|off] - Collect performance counters (current: ' . ($config{counters} // 'on') . ')';
 
 my @objects = qw(events midi_files patch_files player);
 my @includes = qw(inc);
@@ -30,7 +40,8 @@ my %opts = (
 sub cc_rule {
     my ($to, $from) = @_;
     rule $to, [$from, 'build-config'], sub {
-        run $ENV{CC}, $from, map("-I$_", @includes), @{$opts{$config{build}}}, qw(-c -std=c99 -o), $to;
+        run $ENV{CC}, $from, map("-I$_", @includes), @{$opts{$config{build}}},
+            ($config{counters} eq 'off' ? ('-DMDV_NO_COUNTERS') : ()), qw(-c -std=c99 -o), $to;
     };
 }
 sub ar_rule {
@@ -40,9 +51,9 @@ sub ar_rule {
     };
 }
 sub ld_rule {
-    my ($to, $from) = @_;
+    my ($to, $from, @libs) = @_;
     rule $to, $from, sub {
-        run $ENV{CC}, @$from, qw(-lSDL2 -lm -o), $to;
+        run $ENV{CC}, @$from, @libs, qw(-lm -lpthread -o), $to;
     };
 }
 
@@ -52,12 +63,19 @@ for (@objects) {
 ar_rule 'midieval.a', [map "tmp/$_.o", @objects];
 cc_rule 'tmp/main_sdl.o', 'src/main_sdl.c';
 cc_rule 'tmp/main_profile.o', 'src/main_profile.c';
-ld_rule 'midieval_sdl', ['tmp/main_sdl.o', 'midieval.a'];
+cc_rule 'tmp/main_bank.o', 'src/main_bank.c';
+ld_rule 'midieval_sdl', ['tmp/main_sdl.o', 'midieval.a'], '-lSDL2';
 ld_rule 'midieval_profile', ['tmp/main_profile.o', 'midieval.a'];
+ld_rule 'midieval_bank', ['tmp/main_bank.o', 'midieval.a'];
+
+ # Writes bench.json; compare two with ./midieval_profile compare old.json new.json
+phony 'bench', ['midieval_profile'], sub {
+    run './midieval_profile', 'bench', '--json', 'bench.json';
+};
 
-rule 'clean', [], sub { unlink 'midieval_sdl', 'midieval_profile', 'midieval.a', glob 'tmp/*'; };
+rule 'clean', [], sub { unlink 'midieval_sdl', 'midieval_profile', 'midieval_bank', 'midieval.a', glob 'tmp/*'; };
 
-defaults 'midieval_sdl', 'midieval_profile';
+defaults 'midieval_sdl', 'midieval_profile', 'midieval_bank';
 
  # Automatically glean subdeps from #includes
 subdep sub {
@@ -5,6 +5,7 @@
 
 void mdv_free_sequence (MDV_Sequence* seq) {
     free(seq->events);
+    free(seq->times);
     free(seq);
 }
 
@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+#include "midieval.h"
+
+ // Usage: midieval_bank patches.cfg patches.bank
+int main (int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: midieval_bank patches.cfg patches.bank\n");
+        return 1;
+    }
+    return mdv_compile_patch_bank(argv[1], argv[2]) ? 0 : 1;
+}
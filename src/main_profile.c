@@ -1,24 +1,675 @@
-
+#define _POSIX_C_SOURCE 200809L
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #include "midieval.h"
 
 uint8_t dat [4096 * 4];
 
+static double wall_time () {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1000000000.0;
+}
+
+ // A patch with one looped sample of n frames of noise that sustains at a
+ //  constant volume, so each note keeps one voice busy until it's released.
+ //  On a drum channel, notes play once through the sample instead.
+static MDV_Patch* noise_patch (uint32_t n) {
+    MDV_Patch* pat = calloc(1, sizeof(MDV_Patch));
+    pat->refs = 1;
+    pat->volume = 64;
+    pat->note = -1;
+    pat->n_samples = 1;
+    pat->samples = calloc(1, sizeof(MDV_Sample));
+    MDV_Sample* s = pat->samples;
+    int16_t* data = malloc((n + 2 * MDV_SAMPLE_GUARD) * sizeof(int16_t));
+    for (uint32_t i = 0; i < n + 2 * MDV_SAMPLE_GUARD; i++)
+        data[i] = i < MDV_SAMPLE_GUARD ? 0 : rand() % 0x2000 - 0x1000;
+     // The back guard continues the loop
+    memcpy(data + MDV_SAMPLE_GUARD + n, data + MDV_SAMPLE_GUARD, MDV_SAMPLE_GUARD * sizeof(int16_t));
+    s->data = data + MDV_SAMPLE_GUARD;
+    s->data_size = n;
+    s->loop_start = 0;
+    s->loop_end = (int64_t)n << 32;
+    s->low_freq = 0;
+    s->high_freq = UINT32_MAX;
+    s->root_freq = 261626 * 0x10000LL / 1000;
+    s->sample_rate = 44100;
+    for (int i = 0; i < 6; i++) {
+        s->envelope_rates[i] = 63 << 9;
+        s->envelope_offsets[i] = 0x3e800000;
+    }
+    s->loop = 1;
+    s->sustain = 1;
+    s->pan = 64;
+    s->scale_factor = 1024;
+    return pat;
+}
+
+ // Hold this many notes with each interpolation mode, and report the time
+ //  per voice-sample.
+#define BENCH_VOICES 64
+#define BENCH_SECONDS 20
+static void bench_interpolation () {
+    static const char* names [] = {"linear", "cubic", "sinc"};
+     // A program change, then the notes, all let go after BENCH_SECONDS
+    MDV_Sequence* seq = malloc(sizeof(MDV_Sequence));
+    seq->tpb = 96;
+    seq->n_events = 1 + 2 * BENCH_VOICES;
+    seq->events = malloc(seq->n_events * sizeof(MDV_Timed_Event));
+    seq->times = malloc(seq->n_events * sizeof(uint64_t));
+    for (uint32_t i = 0; i < seq->n_events; i++) {
+        MDV_Timed_Event* te = &seq->events[i];
+        int off = i > BENCH_VOICES;
+        te->time = 0;
+        te->event.type = i == 0 ? MDV_PROGRAM_CHANGE : off ? MDV_NOTE_OFF : MDV_NOTE_ON;
+        te->event.channel = 0;
+         // Spread the notes out so voices step at different rates
+        te->event.param1 = i == 0 ? 0 : 36 + (off ? i - BENCH_VOICES - 1 : i - 1) * 64 / BENCH_VOICES;
+        te->event.param2 = 100;
+        seq->times[i] = off ? (uint64_t)BENCH_SECONDS * 1000000 << 20 : 0;
+    }
+    uint32_t blocks = BENCH_SECONDS * MDV_SAMPLE_RATE / 4096;
+    for (int mode = MDV_LINEAR; mode <= MDV_SINC; mode++) {
+        MDV_Player* player = mdv_new_player();
+        mdv_set_interpolation(player, mode);
+        mdv_set_patch(player, 0, 0, noise_patch(4096));
+        mdv_play_sequence(player, seq);
+        double start = wall_time();
+        for (uint32_t i = 0; i < blocks; i++)
+            mdv_get_audio(player, dat, 4096 * 4);
+        double end = wall_time();
+        printf("%-6s  %.3f ns per voice-sample\n", names[mode],
+            (end - start) * 1e9 / ((double)blocks * 4096 * BENCH_VOICES)
+        );
+        mdv_free_player(player);
+    }
+    mdv_free_sequence(seq);
+}
+
+ // Everything one player needs, made from scratch so nothing is shared
+typedef struct Song_Render {
+    const char* cfg;
+    const char* song;
+    uint8_t* out;
+    size_t len;
+} Song_Render;
+
+static void* render_song (void* job_) {
+    Song_Render* job = (Song_Render*)job_;
+    MDV_Player* player = mdv_new_player();
+    mdv_load_config(player, job->cfg);
+    MDV_Sequence* seq = mdv_load_midi(job->song);
+    mdv_play_sequence(player, seq);
+    size_t max = 0;
+    job->out = NULL;
+    job->len = 0;
+    while (mdv_currently_playing(player)) {
+        if (job->len + sizeof(dat) > max) {
+            max = max ? max * 2 : 1 << 20;
+            job->out = realloc(job->out, max);
+        }
+        mdv_get_audio(player, job->out + job->len, sizeof(dat));
+        job->len += sizeof(dat);
+    }
+    mdv_free_player(player);
+    mdv_free_sequence(seq);
+    return NULL;
+}
+
+ // Render the song once alone, then on n_threads players on their own threads
+ //  all at once, and check that every one matches.
+static int check_reentrant (const char* cfg, const char* song, int n_threads) {
+    Song_Render serial = {cfg, song, NULL, 0};
+    double start = wall_time();
+    render_song(&serial);
+    double serial_time = wall_time() - start;
+    Song_Render* jobs = malloc(n_threads * sizeof(Song_Render));
+    pthread_t* threads = malloc(n_threads * sizeof(pthread_t));
+    start = wall_time();
+    for (int i = 0; i < n_threads; i++) {
+        jobs[i] = serial;
+        if (pthread_create(&threads[i], NULL, render_song, &jobs[i]) != 0) {
+            fprintf(stderr, "Could not start thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    double parallel_time = wall_time() - start;
+    int failed = 0;
+    for (int i = 0; i < n_threads; i++) {
+        if (jobs[i].len != serial.len || memcmp(jobs[i].out, serial.out, serial.len) != 0) {
+            printf("Player %d doesn't match the serial render\n", i);
+            failed = 1;
+        }
+        free(jobs[i].out);
+    }
+    printf("%d players on %d threads: %s\n", n_threads, n_threads, failed ? "MISMATCH" : "identical");
+    printf("Serial: %f s for one, parallel: %f s for %d\n", serial_time, parallel_time, n_threads);
+    free(serial.out);
+    free(jobs);
+    free(threads);
+    return failed;
+}
+
+///// Benchmark suite /////
+
+ // Synthetic songs are built from events at times in seconds, in any order
+typedef struct Song_Event {
+    uint64_t time;  // As in MDV_Sequence
+    uint32_t order;  // Events at the same time keep the order they were added
+    MDV_Event event;
+} Song_Event;
+
+typedef struct Song {
+    uint32_t n_events;
+    uint32_t max_events;
+    Song_Event* events;
+} Song;
+
+static void add_event (Song* song, double seconds, uint8_t type, uint8_t channel, uint8_t param1, uint8_t param2) {
+    if (song->n_events >= song->max_events) {
+        song->max_events = song->max_events ? song->max_events * 2 : 256;
+        song->events = realloc(song->events, song->max_events * sizeof(Song_Event));
+    }
+    Song_Event* e = &song->events[song->n_events];
+    e->time = (uint64_t)(seconds * 1000000 * (1 << 20));
+    e->order = song->n_events++;
+    e->event.type = type;
+    e->event.channel = channel;
+    e->event.param1 = param1;
+    e->event.param2 = param2;
+}
+
+static int cmp_song_events (const void* a_, const void* b_) {
+    const Song_Event* a = a_;
+    const Song_Event* b = b_;
+    if (a->time != b->time) return a->time < b->time ? -1 : 1;
+    return a->order < b->order ? -1 : a->order > b->order;
+}
+
+ // Sorts the events into a sequence, and frees the song
+static MDV_Sequence* finish_song (Song* song) {
+    qsort(song->events, song->n_events, sizeof(Song_Event), cmp_song_events);
+    MDV_Sequence* seq = malloc(sizeof(MDV_Sequence));
+    seq->tpb = 96;
+    seq->n_events = song->n_events;
+    seq->events = malloc(seq->n_events * sizeof(MDV_Timed_Event));
+    seq->times = malloc(seq->n_events * sizeof(uint64_t));
+    for (uint32_t i = 0; i < seq->n_events; i++) {
+        seq->events[i].time = 0;
+        seq->events[i].event = song->events[i].event;
+        seq->times[i] = song->events[i].time;
+    }
+    free(song->events);
+    return seq;
+}
+
+ // Channel and note for the ith of up to 255 simultaneous notes.  Skips the
+ //  drum channel and spreads pitches so voices step at different rates.
+static uint8_t held_channel (int i) { return i / 64 >= 9 ? i / 64 + 1 : i / 64; }
+static uint8_t held_note (int i) { return 36 + i % 64; }
+
+ // n notes held for the whole song
+static void add_held_notes (Song* song, int n, double seconds) {
+    for (int c = 0; c < 16; c++)
+        add_event(song, 0, MDV_PROGRAM_CHANGE, c, 0, 0);
+    for (int i = 0; i < n; i++) {
+        add_event(song, 0, MDV_NOTE_ON, held_channel(i), held_note(i), 100);
+        add_event(song, seconds, MDV_NOTE_OFF, held_channel(i), held_note(i), 0);
+    }
+}
+
+ // n notes (up to 64 on drums) struck again every period seconds
+static void add_repeated_notes (Song* song, int n, int drums, double period, double seconds) {
+    for (int c = 0; c < 16; c++)
+        add_event(song, 0, MDV_PROGRAM_CHANGE, c, 0, 0);
+    for (double t = 0; t < seconds; t += period) {
+        for (int i = 0; i < n; i++) {
+            uint8_t channel = drums ? 9 : held_channel(i);
+            add_event(song, t, MDV_NOTE_ON, channel, held_note(i), 100);
+            add_event(song, t + period * 0.99, MDV_NOTE_OFF, channel, held_note(i), 0);
+        }
+    }
+}
+
+typedef void Bench_Setup (MDV_Player*);
+
+static void setup_looped (MDV_Player* player) {
+    mdv_set_polyphony(player, 255);
+    mdv_set_patch(player, 0, 0, noise_patch(4096));
+}
+ // Drums don't loop, so these notes end on their own after a quarter second,
+ //  halfway to being struck again.  Every note plays at its sample's own
+ //  pitch so they all last the same, and gets its own noise so they don't
+ //  add up in phase.
+static void setup_one_shot (MDV_Player* player) {
+    mdv_set_polyphony(player, 255);
+    for (int i = 0; i < 64; i++) {
+        MDV_Patch* pat = noise_patch(11025);
+        pat->note = 60;
+        mdv_set_drum(player, 0, held_note(i), pat);
+    }
+}
+#define BENCH_DRUMS 16
+#define FIRST_DRUM 35
+static void setup_drums (MDV_Player* player) {
+    mdv_set_polyphony(player, 255);
+    for (int d = 0; d < BENCH_DRUMS; d++)
+        mdv_set_drum(player, 0, FIRST_DRUM + d, noise_patch(2048 + d * 1024));
+}
+
+typedef struct Bench_Result {
+    char name [256];
+    uint64_t frames;
+    double audio_seconds;
+    double wall_seconds;
+    MDV_Counters counters;
+} Bench_Result;
+
+typedef struct Bench_Options {
+    int repeat;
+    double seconds;
+    FILE* json;
+    int n_results;
+} Bench_Options;
+
+static void write_result (Bench_Options* opts, Bench_Result* r) {
+    double realtime = r->audio_seconds / r->wall_seconds;
+    uint64_t* st = r->counters.stage_ns;
+    double per_voice_sample = r->counters.voice_samples
+        ? r->wall_seconds * 1e9 / r->counters.voice_samples : 0;
+    fprintf(opts->json, "%s\n  {\"name\": \"%s\", \"frames\": %llu, \"audio_seconds\": %.3f, \"wall_seconds\": %.6f,"
+        " \"realtime\": %.2f, \"voice_samples\": %llu, \"ns_per_voice_sample\": %.4f,"
+        " \"stages_ns\": {\"events\": %llu, \"control\": %llu, \"mix\": %llu, \"effects\": %llu, \"output\": %llu},"
+        " \"blocks\": %llu, \"control_updates\": %llu, \"events\": %llu, \"max_active_voices\": %lu,"
+        " \"dropped_notes\": %llu, \"clipped_samples\": %llu, \"peak\": %lu}",
+        opts->n_results ? "," : "",
+        r->name, (unsigned long long)r->frames, r->audio_seconds, r->wall_seconds,
+        realtime, (unsigned long long)r->counters.voice_samples, per_voice_sample,
+        (unsigned long long)st[MDV_STAGE_EVENTS], (unsigned long long)st[MDV_STAGE_CONTROL],
+        (unsigned long long)st[MDV_STAGE_MIX], (unsigned long long)st[MDV_STAGE_EFFECTS],
+        (unsigned long long)st[MDV_STAGE_OUTPUT],
+        (unsigned long long)r->counters.blocks, (unsigned long long)r->counters.control_updates,
+        (unsigned long long)r->counters.events, (unsigned long)r->counters.max_active_voices,
+        (unsigned long long)r->counters.dropped_notes, (unsigned long long)r->counters.clipped_samples,
+        (unsigned long)r->counters.peak
+    );
+    opts->n_results += 1;
+     // And something readable on stderr
+    double total = 0;
+    for (int i = 0; i < MDV_N_STAGES; i++)
+        total += st[i];
+    if (total == 0) total = 1;
+    fprintf(stderr, "%-32s %9.1fx realtime %8.3f ns/voice-sample  events %4.1f%%  control %4.1f%%  mix %4.1f%%  effects %4.1f%%  output %4.1f%%  %3lu max %5.1f mean voices\n",
+        r->name, realtime, per_voice_sample,
+        100 * st[MDV_STAGE_EVENTS] / total, 100 * st[MDV_STAGE_CONTROL] / total,
+        100 * st[MDV_STAGE_MIX] / total, 100 * st[MDV_STAGE_EFFECTS] / total,
+        100 * st[MDV_STAGE_OUTPUT] / total, (unsigned long)r->counters.max_active_voices,
+        (double)r->counters.voice_samples / r->frames
+    );
+     // Either would make the timing mean something different
+    if (r->counters.dropped_notes)
+        fprintf(stderr, "  %llu notes dropped\n", (unsigned long long)r->counters.dropped_notes);
+    if (r->counters.clipped_samples)
+        fprintf(stderr, "  %llu samples clipped\n", (unsigned long long)r->counters.clipped_samples);
+}
+
+ // Render seq on a fresh player opts->repeat times, and keep the fastest
+static void run_bench (
+    Bench_Options* opts, const char* name, MDV_Sequence* seq,
+    Bench_Setup* setup, MDV_Patch_Library* lib
+) {
+    Bench_Result best;
+    best.wall_seconds = 0;
+    for (int r = 0; r < opts->repeat; r++) {
+        MDV_Player* player = mdv_new_player();
+        if (lib) mdv_use_patch_library(player, lib);
+        if (setup) setup(player);
+        mdv_play_sequence(player, seq);
+        if (lib) mdv_wait_patch_library(lib);
+        uint64_t frames = 0;
+        double start = wall_time();
+        while (mdv_currently_playing(player)) {
+            mdv_get_audio(player, dat, sizeof(dat));
+            frames += sizeof(dat) / 4;
+        }
+        double wall = wall_time() - start;
+        if (r == 0 || wall < best.wall_seconds) {
+             // Names go in JSON strings, so keep them plain
+            snprintf(best.name, sizeof(best.name), "%.*s", (int)sizeof(best.name) - 1, name);
+            for (char* c = best.name; *c; c++)
+                if (*c == '"' || *c == '\\' || (unsigned char)*c < ' ') *c = '_';
+            best.frames = frames;
+            best.audio_seconds = (double)frames / mdv_get_sample_rate(player);
+            best.wall_seconds = wall;
+            mdv_get_counters(player, &best.counters);
+        }
+        mdv_free_player(player);
+    }
+    write_result(opts, &best);
+}
+
+static void bench_synthetic (Bench_Options* opts) {
+    double secs = opts->seconds;
+    char name [64];
+     // How the cost grows with voices
+    static const int sweep [] = {1, 2, 4, 8, 16, 32, 64, 128, 192, 255};
+    for (uint32_t i = 0; i < sizeof(sweep) / sizeof(sweep[0]); i++) {
+        Song song = {0};
+        add_held_notes(&song, sweep[i], secs);
+        MDV_Sequence* seq = finish_song(&song);
+        snprintf(name, sizeof(name), "polyphony/%d", sweep[i]);
+        run_bench(opts, name, seq, setup_looped, NULL);
+        mdv_free_sequence(seq);
+    }
+     // The same notes looping until released, and playing once on drums
+    for (int loop = 1; loop >= 0; loop--) {
+        Song song = {0};
+        add_repeated_notes(&song, 64, !loop, 0.5, secs);
+        MDV_Sequence* seq = finish_song(&song);
+        run_bench(opts, loop ? "patches/looped" : "patches/one-shot", seq,
+            loop ? setup_looped : setup_one_shot, NULL
+        );
+        mdv_free_sequence(seq);
+    }
+     // Lots of short notes starting and ending: four drums every 32nd note
+     //  at 120 BPM, with a roll on top
+    {
+        Song song = {0};
+        int step = 0;
+        for (double t = 0; t < secs; t += 1 / 16.0, step++) {
+            for (int k = 0; k < 4; k++) {
+                uint8_t drum = FIRST_DRUM + (step * 5 + k * 3) % BENCH_DRUMS;
+                add_event(&song, t, MDV_NOTE_ON, 9, drum, 90 + k * 10);
+                add_event(&song, t + 0.05, MDV_NOTE_OFF, 9, drum, 0);
+            }
+            add_event(&song, t + 1 / 32.0, MDV_NOTE_ON, 9, FIRST_DRUM + step % BENCH_DRUMS, 60);
+        }
+        MDV_Sequence* seq = finish_song(&song);
+        run_bench(opts, "drums", seq, setup_drums, NULL);
+        mdv_free_sequence(seq);
+    }
+     // Tempo is already applied to event times, so what a storm of tempo
+     //  changes costs is dispatching them and cutting chunks short.  One
+     //  every millisecond, over 32 held notes.
+    {
+        Song song = {0};
+        add_held_notes(&song, 32, secs);
+        for (double t = 0; t < secs; t += 0.001) {
+            uint32_t tempo = 500000 + (uint32_t)(t * 1000) % 64 * 1000;
+            add_event(&song, t, MDV_SET_TEMPO, tempo >> 16, tempo >> 8, tempo);
+        }
+        MDV_Sequence* seq = finish_song(&song);
+        run_bench(opts, "tempo-storm", seq, setup_looped, NULL);
+        mdv_free_sequence(seq);
+    }
+     // 32 held notes sent to reverb and chorus
+    {
+        Song song = {0};
+        add_held_notes(&song, 32, secs);
+        for (int c = 0; c < 16; c++) {
+            add_event(&song, 0, MDV_CONTROLLER, c, MDV_REVERB, 100);
+            add_event(&song, 0, MDV_CONTROLLER, c, MDV_CHORUS, 100);
+        }
+        MDV_Sequence* seq = finish_song(&song);
+        run_bench(opts, "effects", seq, setup_looped, NULL);
+        mdv_free_sequence(seq);
+    }
+}
+
+static int cmp_strings (const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int is_midi_file (const char* name) {
+    size_t len = strlen(name);
+    for (int i = 0; i < 2; i++) {
+        const char* ext = i ? ".midi" : ".mid";
+        size_t ext_len = strlen(ext);
+        if (len > ext_len) {
+            int match = 1;
+            for (size_t j = 0; j < ext_len; j++)
+                if ((name[len - ext_len + j] | 0x20) != ext[j]) match = 0;
+            if (match) return 1;
+        }
+    }
+    return 0;
+}
+
+ // Every MIDI file in dir, in name order
+static void bench_corpus (Bench_Options* opts, const char* dir, const char* cfg) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Could not open %s\n", dir);
+        exit(1);
+    }
+    uint32_t n_files = 0;
+    uint32_t max_files = 64;
+    char** files = malloc(max_files * sizeof(char*));
+    struct dirent* ent;
+    while ((ent = readdir(d))) {
+        if (!is_midi_file(ent->d_name)) continue;
+        if (n_files >= max_files) {
+            max_files *= 2;
+            files = realloc(files, max_files * sizeof(char*));
+        }
+        files[n_files++] = strdup(ent->d_name);
+    }
+    closedir(d);
+    qsort(files, n_files, sizeof(char*), cmp_strings);
+    MDV_Patch_Library* lib = mdv_load_patch_library(cfg);
+    for (uint32_t i = 0; i < n_files; i++) {
+        char path [4096];
+        char name [4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        snprintf(name, sizeof(name), "corpus/%s", files[i]);
+        MDV_Sequence* seq = mdv_load_midi(path);
+        run_bench(opts, name, seq, NULL, lib);
+        mdv_free_sequence(seq);
+        free(files[i]);
+    }
+    free(files);
+    mdv_free_patch_library(lib);
+}
+
+static int bench (int argc, char** argv) {
+    Bench_Options opts = {3, 10, stdout, 0};
+    const char* corpus = NULL;
+    const char* cfg = "/usr/local/share/eawpats/gravis.cfg";
+    int synthetic = 1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc)
+            corpus = argv[++i];
+        else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+            cfg = argv[++i];
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            opts.repeat = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            opts.seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            opts.json = fopen(argv[++i], "w");
+            if (!opts.json) {
+                fprintf(stderr, "Could not open %s for writing\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--no-synthetic") == 0)
+            synthetic = 0;
+        else {
+            fprintf(stderr, "Unknown bench option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (opts.repeat < 1) opts.repeat = 1;
+    fprintf(opts.json, "{\"benchmarks\": [");
+    if (synthetic)
+        bench_synthetic(&opts);
+    if (corpus)
+        bench_corpus(&opts, corpus, cfg);
+    fprintf(opts.json, "\n]}\n");
+    if (opts.json != stdout)
+        fclose(opts.json);
+    return 0;
+}
+
+ // Only reads what bench writes, one result per line, and only as far as the
+ //  stage times
+static Bench_Result* read_results (const char* filename, int* n) {
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Could not open %s for reading\n", filename);
+        exit(1);
+    }
+    int max = 64;
+    Bench_Result* results = malloc(max * sizeof(Bench_Result));
+    *n = 0;
+    char line [8192];
+    while (fgets(line, sizeof(line), f)) {
+        if (*n >= max) {
+            max *= 2;
+            results = realloc(results, max * sizeof(Bench_Result));
+        }
+        Bench_Result* r = &results[*n];
+        unsigned long long frames, voice_samples, st [MDV_N_STAGES];
+        double realtime, per_voice_sample;
+        int got = sscanf(line, " {\"name\": \"%255[^\"]\", \"frames\": %llu, \"audio_seconds\": %lf, \"wall_seconds\": %lf,"
+            " \"realtime\": %lf, \"voice_samples\": %llu, \"ns_per_voice_sample\": %lf,"
+            " \"stages_ns\": {\"events\": %llu, \"control\": %llu, \"mix\": %llu, \"effects\": %llu, \"output\": %llu}}",
+            r->name, &frames, &r->audio_seconds, &r->wall_seconds, &realtime,
+            &voice_samples, &per_voice_sample,
+            &st[MDV_STAGE_EVENTS], &st[MDV_STAGE_CONTROL], &st[MDV_STAGE_MIX],
+            &st[MDV_STAGE_EFFECTS], &st[MDV_STAGE_OUTPUT]
+        );
+        if (got != 12) continue;
+        r->frames = frames;
+        r->counters.voice_samples = voice_samples;
+        for (int i = 0; i < MDV_N_STAGES; i++)
+            r->counters.stage_ns[i] = st[i];
+        *n += 1;
+    }
+    fclose(f);
+    return results;
+}
+
+ // Compare two runs of bench by wall time per second of audio, and flag
+ //  anything that got slower by more than threshold percent.  Exits with 1
+ //  if anything did.
+static int compare (const char* old_file, const char* new_file, double threshold) {
+    static const char* stage_names [MDV_N_STAGES] = {"events", "control", "mix", "effects", "output"};
+    int n_old, n_new;
+    Bench_Result* olds = read_results(old_file, &n_old);
+    Bench_Result* news = read_results(new_file, &n_new);
+    int regressions = 0;
+    printf("%-32s %10s %10s %8s\n", "benchmark", "old x", "new x", "change");
+    for (int i = 0; i < n_new; i++) {
+        Bench_Result* b = &news[i];
+        Bench_Result* a = NULL;
+        for (int j = 0; j < n_old; j++)
+            if (strcmp(olds[j].name, b->name) == 0) a = &olds[j];
+        if (!a) {
+            printf("%-32s %10s %10.1f %8s\n", b->name, "-", b->audio_seconds / b->wall_seconds, "new");
+            continue;
+        }
+        double old_cost = a->wall_seconds / a->audio_seconds;
+        double new_cost = b->wall_seconds / b->audio_seconds;
+        double change = (new_cost / old_cost - 1) * 100;
+        int regressed = change > threshold;
+        printf("%-32s %10.1f %10.1f %+7.1f%%", b->name, 1 / old_cost, 1 / new_cost, change);
+        if (regressed) {
+            regressions += 1;
+             // Point at the stage that grew the most
+            int worst = 0;
+            double worst_growth = 0;
+            for (int s = 0; s < MDV_N_STAGES; s++) {
+                double growth = b->counters.stage_ns[s] / b->audio_seconds
+                              - a->counters.stage_ns[s] / a->audio_seconds;
+                if (growth > worst_growth) {
+                    worst = s;
+                    worst_growth = growth;
+                }
+            }
+            printf("  REGRESSION (mostly %s)", stage_names[worst]);
+        }
+        printf("\n");
+    }
+    for (int j = 0; j < n_old; j++) {
+        int found = 0;
+        for (int i = 0; i < n_new; i++)
+            if (strcmp(olds[j].name, news[i].name) == 0) found = 1;
+        if (!found)
+            printf("%-32s %10.1f %10s %8s\n", olds[j].name, olds[j].audio_seconds / olds[j].wall_seconds, "-", "gone");
+    }
+    printf("%d regression%s over %g%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+    free(olds);
+    free(news);
+    return regressions ? 1 : 0;
+}
+
+ // Usage: midieval_profile [song.mid [threads]]
+ //  With a thread count, renders offline with mdv_render_sequence.
+ // Or: midieval_profile interpolation
+ //  Times each interpolation mode on synthetic voices.
+ // Or: midieval_profile reentrant song.mid [threads [config.cfg]]
+ //  Renders on many independent players at once and checks they all match.
+ // Or: midieval_profile bench [--corpus dir] [--config config.cfg]
+ //                            [--repeat n] [--seconds s] [--json file]
+ //                            [--no-synthetic]
+ //  Runs the synthetic stress songs and every MIDI file in the corpus
+ //  directory, and writes the results as JSON (to stdout by default).  Each
+ //  is rendered repeat times (default 3) and the fastest run is kept.
+ // Or: midieval_profile compare old.json new.json [percent]
+ //  Flags benchmarks that got slower by more than percent (default 10).
 int main (int argc, char** argv) {
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+        return bench(argc, argv);
+    if (argc >= 4 && strcmp(argv[1], "compare") == 0)
+        return compare(argv[2], argv[3], argc >= 5 ? atof(argv[4]) : 10);
+    if (argc >= 2 && strcmp(argv[1], "interpolation") == 0) {
+        bench_interpolation();
+        return 0;
+    }
+    if (argc >= 3 && strcmp(argv[1], "reentrant") == 0) {
+        return check_reentrant(
+            argc >= 5 ? argv[4] : "/usr/local/share/eawpats/gravis.cfg",
+            argv[2], argc >= 4 ? atoi(argv[3]) : 8
+        );
+    }
     MDV_Player* player = mdv_new_player();
     mdv_load_config(player, "/usr/local/share/eawpats/gravis.cfg");
-    MDV_Sequence* seq = mdv_load_midi(argc == 2 ? argv[1] : "test.mid");
-    mdv_play_sequence(player, seq);
-    printf("dat: %p, player: %p, seq: %p\n", dat, player, seq);
+    MDV_Sequence* seq = mdv_load_midi(argc >= 2 ? argv[1] : "test.mid");
 
-    clock_t start = clock();
-    while (mdv_currently_playing(player)) {
-        mdv_get_audio(player, dat, 4096 * 4);
+    if (argc >= 3) {
+        double start = wall_time();
+        size_t len;
+        uint8_t* buf = mdv_render_sequence(player, seq, atoi(argv[2]), &len);
+        double end = wall_time();
+        printf("Time to render song offline on %d threads: %f\n", atoi(argv[2]), end - start);
+        free(buf);
+    }
+    else {
+        mdv_play_sequence(player, seq);
+        printf("dat: %p, player: %p, seq: %p\n", dat, player, seq);
+        clock_t start = clock();
+        while (mdv_currently_playing(player)) {
+            mdv_get_audio(player, dat, 4096 * 4);
+        }
+        clock_t end = clock();
+        printf("Time to render song: %f\n", (double)(end - start)/CLOCKS_PER_SEC);
+        MDV_Counters c;
+        mdv_get_counters(player, &c);
+        printf("Clip count: %llu\n", (unsigned long long)c.clipped_samples);
+        printf("Max value: %08lx\n", (unsigned long)c.peak);
+        printf("Max voices: %lu (%llu notes dropped)\n",
+            (unsigned long)c.max_active_voices, (unsigned long long)c.dropped_notes
+        );
     }
-    clock_t end = clock();
-    printf("Time to render song: %f\n", (double)(end - start)/CLOCKS_PER_SEC);
     mdv_free_player(player);
     mdv_free_sequence(seq);
     return 0;
@@ -4,6 +4,41 @@
 
 #include "midieval.h"
 
+ // Where the audio callback had got to, so typed events can be timed to the
+ //  sample.  seq is odd while the callback is writing.
+typedef struct Audio_Clock {
+    MDV_Player* player;
+    uint32_t seq;
+    uint64_t clock;
+    uint64_t ticks;
+} Audio_Clock;
+
+static void audio_callback (void* userdata, uint8_t* buf, int len) {
+    Audio_Clock* ac = userdata;
+    mdv_get_audio(ac->player, buf, len);
+    uint64_t clock = mdv_get_clock(ac->player);
+    uint64_t ticks = SDL_GetPerformanceCounter();
+    __atomic_store_n(&ac->seq, ac->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&ac->clock, clock, __ATOMIC_RELAXED);
+    __atomic_store_n(&ac->ticks, ticks, __ATOMIC_RELAXED);
+    __atomic_store_n(&ac->seq, ac->seq + 1, __ATOMIC_RELEASE);
+}
+
+ // The sample playing now, give or take a constant latency
+static uint64_t audio_now (Audio_Clock* ac, uint32_t freq) {
+    uint32_t seq;
+    uint64_t clock, ticks;
+    do {
+        seq = __atomic_load_n(&ac->seq, __ATOMIC_ACQUIRE);
+        clock = __atomic_load_n(&ac->clock, __ATOMIC_RELAXED);
+        ticks = __atomic_load_n(&ac->ticks, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (seq & 1 || seq != __atomic_load_n(&ac->seq, __ATOMIC_RELAXED));
+    uint64_t elapsed = SDL_GetPerformanceCounter() - ticks;
+    return clock + elapsed * freq / SDL_GetPerformanceFrequency();
+}
+
 int main (int argc, char** argv) {
     if (SDL_Init(SDL_INIT_AUDIO) < 0) {
         printf("SDL_Init failed: %s\n", SDL_GetError());
@@ -11,24 +46,30 @@ int main (int argc, char** argv) {
 
      // Set up player
     MDV_Player* player = mdv_new_player();
-    mdv_load_config(player, "/usr/local/share/eawpats/gravis.cfg");
+     // Only load the patches the song uses
+    MDV_Patch_Library* lib = mdv_index_patch_library("/usr/local/share/eawpats/gravis.cfg");
+    mdv_use_patch_library(player, lib);
     MDV_Sequence* seq = mdv_load_midi(argc == 2 ? argv[1] : "sample/test.mid");
     mdv_play_sequence(player, seq);
+    mdv_wait_patch_library(lib);
+    mdv_free_patch_library(lib);
     mdv_fast_forward_to_note(player);
 
      // Set up SDL audio
     SDL_AudioSpec spec;
-    spec.freq = MDV_SAMPLE_RATE;
+    spec.freq = mdv_get_sample_rate(player);
     spec.format = AUDIO_S16;
     spec.channels = 2;
     spec.samples = 4096;
-    spec.callback = (void(*)(void*,uint8_t*,int))mdv_get_audio;
-    spec.userdata = player;
+    Audio_Clock ac = {player, 0, 0, 0};
+    spec.callback = audio_callback;
+    spec.userdata = &ac;
     SDL_AudioDeviceID dev = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
     if (dev == 0) {
         printf("SDL_OpenAudioDevice failed: %s\n", SDL_GetError());
     }
 
+    ac.ticks = SDL_GetPerformanceCounter();
     SDL_PauseAudioDevice(dev, 0);
      // Interpret manually entered events in hex, for testing
     char buf [512];
@@ -54,9 +95,12 @@ int main (int argc, char** argv) {
         event.param1 = len >= 2 ? buf[1] : 0;
         event.param2 = len >= 3 ? buf[2] : 0;
         mdv_print_event(&event);
-        SDL_LockAudioDevice(dev);
-        mdv_play_event(player, &event);
-        SDL_UnlockAudioDevice(dev);
+         // The callback renders a block ahead of what's playing, so aim a
+         //  block past now.  That keeps the latency constant instead of
+         //  snapping events to block boundaries.
+        uint64_t at = audio_now(&ac, spec.freq) + spec.samples;
+        if (!mdv_queue_event(player, at, &event))
+            printf("Event queue full, dropped event\n");
     }
     end: { }
     SDL_PauseAudioDevice(dev, 1);
@@ -1,9 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
 #include "midieval.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static uint32_t read_u32 (uint8_t* data) {
     return data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
@@ -26,13 +32,199 @@ static uint32_t read_var (uint8_t** p, uint8_t* end) {
     return r;
 }
 
-static int cmp_event (const void* a_, const void* b_) {
-    MDV_Timed_Event* a = (MDV_Timed_Event*)a_;
-    MDV_Timed_Event* b = (MDV_Timed_Event*)b_;
-    return (a->time > b->time) - (a->time < b->time);
+typedef struct Track {
+    uint8_t* begin;
+    uint8_t* end;
+    uint32_t n_events;
+    MDV_Timed_Event* events;
+} Track;
+
+ // Longest event we need to see all at once: a delta time, status byte, meta
+ //  type, length, and a tempo.  Longer payloads are skipped without reading.
+#define MAX_EVENT_BYTES 16
+
+ // Decodes one event from a track, using and updating its running status and
+ //  time.  Returns 1 if it's an event we use.  *skip is set to how many bytes
+ //  of payload after *p to skip, which the caller has to check.
+static int decode_event (
+    uint8_t** p_, uint8_t* end, uint8_t* status, uint32_t* time,
+    MDV_Timed_Event* out, uint32_t* skip
+) {
+    uint8_t* p = *p_;
+    int r = 0;
+    *skip = 0;
+    *time += read_var(&p, end);
+    out->time = *time;
+    MDV_Event* ev = &out->event;
+    if (end - p < 1) goto premature_end;
+     // Optional type/channel byte
+    uint8_t byte = *p;
+    if (byte & 0x80) {
+        ev->type = byte >> 4;
+        ev->channel = byte & 0x0f;
+        *status = byte;
+        p++;
+    }
+    else {
+        ev->type = *status >> 4;
+        ev->channel = *status & 0x0f;
+    }
+     // Special event
+    if (ev->type == 0x0f) {
+         // Meta event
+        if (ev->channel == 0x0f) {
+            if (end - p < 1) goto premature_end;
+            uint8_t meta_type = *p++;
+            uint32_t size = read_var(&p, end);
+             // Set Tempo
+            if (meta_type == 0x51) {
+                if (size != 3) {
+                    fprintf(stderr, "Tempo event was of incorrect size\n");
+                    exit(1);
+                }
+                if (end - p < 3) goto premature_end;
+                ev->type = MDV_SET_TEMPO;
+                ev->channel = p[0];
+                ev->param1 = p[1];
+                ev->param2 = p[2];
+                r = 1;
+            }
+             // Otherwise ignore
+            *skip = size;
+        }
+         // Ignore SYSEX
+        else {
+            *skip = read_var(&p, end);
+        }
+    }
+     // Normal event
+    else {
+        if (end - p < mdv_parameters_used(ev->type)) goto premature_end;
+        ev->param1 = *p++;
+        if (mdv_parameters_used(ev->type) == 2)
+            ev->param2 = *p++;
+        else
+            ev->param2 = 0;
+        r = 1;
+    }
+    *p_ = p;
+    return r;
+  premature_end:
+    fprintf(stderr, "Premature end of track while parsing event\n");
+    exit(1);
+}
+
+ // Events come out already sorted, since delta times can't be negative.
+static void decode_track (Track* track) {
+    uint8_t* p = track->begin;
+    uint8_t* end = track->end;
+    size_t max_events = 256;
+    track->events = malloc(max_events * sizeof(MDV_Timed_Event));
+    track->n_events = 0;
+    uint32_t time = 0;
+    uint8_t status = 0x80;  // Doesn't really matter
+    while (p != end) {
+        if (track->n_events >= max_events) {
+            max_events *= 2;
+            track->events = realloc(track->events, max_events * sizeof(MDV_Timed_Event));
+        }
+        uint32_t skip;
+        if (decode_event(&p, end, &status, &time, &track->events[track->n_events], &skip))
+            track->n_events += 1;
+        if (end - p < skip) {
+            fprintf(stderr, "Premature end of track while parsing event\n");
+            exit(1);
+        }
+        p += skip;
+    }
+}
+
+typedef struct Decode_Job {
+    Track* tracks;
+    uint32_t n_tracks;
+    uint32_t next;
+} Decode_Job;
+
+static void* decode_job (void* job_) {
+    Decode_Job* job = (Decode_Job*)job_;
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_tracks)
+        decode_track(&job->tracks[i]);
+    return NULL;
+}
+
+ // Stable k-way merge with a binary heap of track heads.  Each key is the
+ //  head's time with its track number below it, so ties go to the earlier
+ //  track and events on the same tick keep file order.
+static void sift_down (uint64_t* heap, uint32_t n, uint32_t i) {
+    uint64_t key = heap[i];
+    for (;;) {
+        uint32_t child = 2*i + 1;
+        if (child >= n) break;
+        if (child + 1 < n && heap[child + 1] < heap[child]) child += 1;
+        if (key <= heap[child]) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = key;
+}
+
+static void merge_tracks (Track* tracks, uint16_t n_tracks, MDV_Timed_Event* out) {
+    uint32_t* pos = calloc(n_tracks, sizeof(uint32_t));
+    uint64_t* heap = malloc(n_tracks * sizeof(uint64_t));
+    uint32_t n = 0;
+    for (uint16_t i = 0; i < n_tracks; i++) {
+        if (tracks[i].n_events)
+            heap[n++] = (uint64_t)tracks[i].events[0].time << 16 | i;
+    }
+    for (uint32_t i = n / 2; i-- > 0;)
+        sift_down(heap, n, i);
+    while (n) {
+        uint16_t t = heap[0] & 0xffff;
+        *out++ = tracks[t].events[pos[t]++];
+        if (pos[t] < tracks[t].n_events)
+            heap[0] = (uint64_t)tracks[t].events[pos[t]].time << 16 | t;
+        else heap[0] = heap[--n];
+        sift_down(heap, n, 0);
+    }
+    free(heap);
+    free(pos);
+}
+
+typedef struct Tempo {
+    uint32_t tick;  // Of the last tempo change
+    uint32_t us_per_beat;
+    uint64_t time;  // Of the last tempo change
+} Tempo;
+
+static void tempo_start (Tempo* tempo) {
+     // Default tempo is 120bpm
+    tempo->tick = 0;
+    tempo->us_per_beat = 500000;
+    tempo->time = 0;
+}
+
+ // Time of a tick at or after the last tempo change, measured from the tempo
+ //  change instead of tick by tick so rounding doesn't build up.
+static uint64_t tempo_time (Tempo* tempo, uint32_t tpb, uint32_t tick) {
+    uint64_t us = (uint64_t)(tick - tempo->tick) * tempo->us_per_beat;
+    return tempo->time + (us / tpb << 20) + (us % tpb << 20) / tpb;
+}
+
+ // Call on every event in order, with the time tempo_time gave it.
+static void tempo_event (Tempo* tempo, const MDV_Timed_Event* te, uint64_t time) {
+    if (te->event.type == MDV_SET_TEMPO) {
+        tempo->tick = te->time;
+        tempo->us_per_beat = te->event.channel << 16 | te->event.param1 << 8 | te->event.param2;
+        tempo->time = time;
+    }
 }
 
 MDV_Sequence* mdv_load_midi (const char* filename) {
+    return mdv_load_midi_threaded(filename, 1);
+}
+
+MDV_Sequence* mdv_load_midi_threaded (const char* filename, int n_threads) {
     FILE* f = fopen(filename, "r");
     if (!f) {
         fprintf(stderr, "Failed to open %s for reading: %s\n", filename, strerror(errno));
@@ -71,113 +263,273 @@ MDV_Sequence* mdv_load_midi (const char* filename) {
         fprintf(stderr, "This program cannot recognize SMTPE-format time divisions.\n");
         exit(1);
     }
-    MDV_Sequence* seq = malloc(sizeof(MDV_Sequence));
-    seq->tpb = tpb;
-    size_t max_events = 256;
-    seq->events = malloc(max_events * sizeof(MDV_Timed_Event));
-    seq->n_events = 0;
-
+     // Find all the tracks first
+    Track* tracks = malloc(n_tracks * sizeof(Track));
     for (uint16_t i = 0; i < n_tracks; i++) {
          // Verify track header
         if (file_end - p < 8) {
             fprintf(stderr, "Premature end of file during chunk header %hu of %hu.\n", i, n_tracks);
-            goto fail;
+            exit(1);
         }
         uint32_t chunk_id = read_u32(p);
         p += 4;
         if (chunk_id != read_u32((uint8_t*)"MTrk")) {
             fprintf(stderr, "Wrong chunk ID %08lx).\n", (unsigned long)chunk_id);
-            goto fail;
+            exit(1);
         }
         uint32_t chunk_size = read_u32(p);
         p += 4;
         if (file_end - p < chunk_size) {
             fprintf(stderr, "Premature end of file during track %hu.\n", i);
-            goto fail;
-        }
-         // Load track's events
-        uint8_t* end = p + chunk_size;
-        uint32_t time = 0;
-        uint8_t status = 0x80;  // Doesn't really matter
-        while (p != end) {
-            if (seq->n_events >= max_events) {
-                max_events *= 2;
-                seq->events = realloc(seq->events, max_events * sizeof(MDV_Timed_Event));
-            }
-            uint32_t delta = read_var(&p, end);
-            time += delta;
-            seq->events[seq->n_events].time = time;
-            MDV_Event* ev = &seq->events[seq->n_events].event;
-            if (end - p < 1) goto premature_end;
-             // Optional type/channel byte
-            uint8_t byte = *p;
-            if (byte & 0x80) {
-                ev->type = byte >> 4;
-                ev->channel = byte & 0x0f;
-                status = byte;
-                p++;
-            }
-            else {
-                ev->type = status >> 4;
-                ev->channel = status & 0x0f;
-            }
-             // Special event
-            if (ev->type == 0x0f) {
-                 // Meta event
-                if (ev->channel == 0x0f) {
-                    if (end - p < 1) goto premature_end;
-                    uint8_t meta_type = *p++;
-                    uint32_t size = read_var(&p, end);
-                    if (end - p < size) goto premature_end;
-                     // Set Tempo
-                    if (meta_type == 0x51) {
-                        if (size != 3) {
-                            fprintf(stderr, "Tempo event was of incorrect size\n");
-                            goto fail;
-                        }
-                        ev->type = MDV_SET_TEMPO;
-                        ev->channel = p[0];
-                        ev->param1 = p[1];
-                        ev->param2 = p[2];
-                        seq->n_events += 1;
-                    }
-                     // Otherwise ignore
-                    p += size;
-                }
-                 // Ignore SYSEX
-                else {
-                    uint32_t size = read_var(&p, end);
-                    if (end - p < size) goto premature_end;
-                    p += size;
-                }
-            }
-             // Normal event
-            else {
-                if (end - p < mdv_parameters_used(ev->type)) goto premature_end;
-                ev->param1 = *p++;
-                if (mdv_parameters_used(ev->type) == 2)
-                    ev->param2 = *p++;
-                else
-                    ev->param2 = 0;
-                seq->n_events += 1;
-            }
+            exit(1);
         }
+        tracks[i].begin = p;
+        tracks[i].end = p + chunk_size;
+        p += chunk_size;
     }
     if (p != file_end) {
         fprintf(stderr, "Warning: extra junk at end of MIDI file.\n");
     }
 
-     // Don't really need to do this, but it helps valgrind analysis
-    seq->events = realloc(seq->events, seq->n_events * sizeof(MDV_Timed_Event));
-     // Now sort the events by time
-    qsort(seq->events, seq->n_events, sizeof(MDV_Timed_Event), cmp_event);
+     // Decode each track into its own sorted run
+    if (n_threads > n_tracks)
+        n_threads = n_tracks;
+    Decode_Job job = {tracks, n_tracks, 0};
+    pthread_t* threads = NULL;
+    if (n_threads > 1) {
+        threads = malloc((n_threads - 1) * sizeof(pthread_t));
+        for (int i = 0; i < n_threads - 1; i++) {
+            if (pthread_create(&threads[i], NULL, decode_job, &job) != 0) {
+                fprintf(stderr, "Could not start track decoding thread\n");
+                exit(1);
+            }
+        }
+    }
+    decode_job(&job);
+    for (int i = 0; i < n_threads - 1; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
 
+    MDV_Sequence* seq = malloc(sizeof(MDV_Sequence));
+    seq->tpb = tpb;
+    seq->n_events = 0;
+    for (uint16_t i = 0; i < n_tracks; i++)
+        seq->n_events += tracks[i].n_events;
+    seq->events = malloc(seq->n_events * sizeof(MDV_Timed_Event));
+    merge_tracks(tracks, n_tracks, seq->events);
+     // Apply the tempo map once here, so the player doesn't have to count ticks
+    seq->times = malloc(seq->n_events * sizeof(uint64_t));
+    Tempo tempo;
+    tempo_start(&tempo);
+    for (uint32_t i = 0; i < seq->n_events; i++) {
+        seq->times[i] = tempo_time(&tempo, tpb, seq->events[i].time);
+        tempo_event(&tempo, &seq->events[i], seq->times[i]);
+    }
+    for (uint16_t i = 0; i < n_tracks; i++)
+        free(tracks[i].events);
+    free(tracks);
     free(data);
     return seq;
-  premature_end:
-    fprintf(stderr, "Premature end of track while parsing event\n");
-  fail:
-    mdv_free_sequence(seq);
-    exit(1);
 }
 
+ // Streaming sequences keep a small window into each track, and merge the
+ //  tracks as they go, so memory doesn't depend on the length of the file.
+
+#define STREAM_WINDOW 256
+
+typedef struct Stream_Track {
+    uint64_t pos;  // Of the end of the window
+    uint64_t end;
+    uint32_t time;
+    uint8_t status;
+    uint16_t window_begin;
+    uint16_t window_end;
+    MDV_Timed_Event head;
+    uint8_t window [STREAM_WINDOW];
+} Stream_Track;
+
+struct MDV_Stream {
+    MDV_Read_Func* read;
+    void* read_data;
+    uint32_t tpb;
+    uint16_t n_tracks;
+    uint16_t n_heads;
+     // Tracks with a head event, keyed like in merge_tracks
+    uint64_t* heap;
+    Stream_Track* tracks;
+     // As of the events already passed
+    Tempo tempo;
+     // Only if we mapped the file ourselves
+    uint8_t* map;
+    size_t map_size;
+};
+
+static void stream_read (MDV_Stream* s, uint64_t offset, void* buf, size_t len) {
+    if (s->read(s->read_data, offset, buf, len) != len) {
+        fprintf(stderr, "Premature end of file while streaming MIDI\n");
+        exit(1);
+    }
+}
+
+ // Decode the track's next event we use into its head.  Returns 0 at the end
+ //  of the track.
+static int stream_advance (MDV_Stream* s, Stream_Track* t) {
+    for (;;) {
+        uint32_t have = t->window_end - t->window_begin;
+        if (have == 0 && t->pos == t->end)
+            return 0;
+         // Top up the window so a whole event fits
+        if (have < MAX_EVENT_BYTES && t->pos < t->end) {
+            memmove(t->window, t->window + t->window_begin, have);
+            uint64_t want = t->end - t->pos;
+            if (want > STREAM_WINDOW - have)
+                want = STREAM_WINDOW - have;
+            stream_read(s, t->pos, t->window + have, want);
+            t->pos += want;
+            t->window_begin = 0;
+            t->window_end = have + want;
+        }
+        uint8_t* p = t->window + t->window_begin;
+        uint8_t* end = t->window + t->window_end;
+        uint32_t skip;
+        int got = decode_event(&p, end, &t->status, &t->time, &t->head, &skip);
+        t->window_begin = p - t->window;
+         // Skip payload, in the window and then in the file
+        uint32_t in_window = t->window_end - t->window_begin;
+        if (skip <= in_window) {
+            t->window_begin += skip;
+        }
+        else {
+            skip -= in_window;
+            t->window_begin = t->window_end;
+            if (t->end - t->pos < skip) {
+                fprintf(stderr, "Premature end of track while parsing event\n");
+                exit(1);
+            }
+            t->pos += skip;
+        }
+        if (got) return 1;
+    }
+}
+
+static size_t read_map (void* s_, uint64_t offset, void* buf, size_t len) {
+    MDV_Stream* s = (MDV_Stream*)s_;
+    if (offset >= s->map_size) return 0;
+    if (len > s->map_size - offset)
+        len = s->map_size - offset;
+    memcpy(buf, s->map + offset, len);
+    return len;
+}
+
+void mdv_rewind_stream (MDV_Stream* s) {
+    s->n_heads = 0;
+    tempo_start(&s->tempo);
+    uint64_t offset = 14;
+    for (uint16_t i = 0; i < s->n_tracks; i++) {
+        uint8_t header [8];
+        stream_read(s, offset, header, 8);
+        if (read_u32(header) != read_u32((uint8_t*)"MTrk")) {
+            fprintf(stderr, "Wrong chunk ID %08lx).\n", (unsigned long)read_u32(header));
+            exit(1);
+        }
+        Stream_Track* t = &s->tracks[i];
+        t->pos = offset + 8;
+        t->end = t->pos + read_u32(header + 4);
+        t->time = 0;
+        t->status = 0x80;
+        t->window_begin = t->window_end = 0;
+        if (stream_advance(s, t))
+            s->heap[s->n_heads++] = (uint64_t)t->head.time << 16 | i;
+        offset = t->end;
+    }
+    for (uint32_t i = s->n_heads / 2; i-- > 0;)
+        sift_down(s->heap, s->n_heads, i);
+}
+
+MDV_Stream* mdv_new_midi_stream (MDV_Read_Func* read, void* data) {
+    MDV_Stream* s = malloc(sizeof(MDV_Stream));
+    s->read = read;
+    s->read_data = data;
+    s->map = NULL;
+    s->map_size = 0;
+    uint8_t header [14];
+    stream_read(s, 0, header, 14);
+    uint32_t magic = read_u32(header);
+    if (magic != read_u32((uint8_t*)"MThd")) {
+        fprintf(stderr, "This file is not a MIDI file (Magic number = %08lx).\n", (unsigned long)magic);
+        exit(1);
+    }
+    s->n_tracks = read_u16(header + 10);
+    s->tpb = read_u16(header + 12);
+    if (s->tpb & 0x8000) {
+        fprintf(stderr, "This program cannot recognize SMTPE-format time divisions.\n");
+        exit(1);
+    }
+    s->tracks = malloc(s->n_tracks * sizeof(Stream_Track));
+    s->heap = malloc(s->n_tracks * sizeof(uint64_t));
+    mdv_rewind_stream(s);
+    return s;
+}
+
+MDV_Stream* mdv_open_midi_stream (const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s for reading: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to stat %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    size_t size = st.st_size;
+    void* map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", filename, size ? strerror(errno) : "File is empty");
+        exit(1);
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+     // Set up the mapping before reading the header through it
+    MDV_Stream tmp;
+    tmp.map = map;
+    tmp.map_size = size;
+    MDV_Stream* s = mdv_new_midi_stream(read_map, &tmp);
+    s->read_data = s;
+    s->map = map;
+    s->map_size = size;
+    return s;
+}
+
+const MDV_Timed_Event* mdv_stream_peek (MDV_Stream* s) {
+    if (!s->n_heads) return NULL;
+    return &s->tracks[s->heap[0] & 0xffff].head;
+}
+
+uint64_t mdv_stream_time (MDV_Stream* s) {
+    if (!s->n_heads) return 0;
+    return tempo_time(&s->tempo, s->tpb, s->tracks[s->heap[0] & 0xffff].head.time);
+}
+
+void mdv_stream_next (MDV_Stream* s) {
+    if (!s->n_heads) return;
+    uint16_t i = s->heap[0] & 0xffff;
+    Stream_Track* t = &s->tracks[i];
+    tempo_event(&s->tempo, &t->head, tempo_time(&s->tempo, s->tpb, t->head.time));
+    if (stream_advance(s, t))
+        s->heap[0] = (uint64_t)t->head.time << 16 | i;
+    else s->heap[0] = s->heap[--s->n_heads];
+    sift_down(s->heap, s->n_heads, 0);
+}
+
+uint32_t mdv_stream_tpb (MDV_Stream* s) {
+    return s->tpb;
+}
+
+void mdv_free_stream (MDV_Stream* s) {
+    if (s->map)
+        munmap(s->map, s->map_size);
+    free(s->heap);
+    free(s->tracks);
+    free(s);
+}
@@ -1,10 +1,18 @@
+#define _POSIX_C_SOURCE 200809L
 #include "midieval.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 enum Sampling_Mode_Bits {
     BITS16 = 0x01,
@@ -17,201 +25,338 @@ enum Sampling_Mode_Bits {
     CLAMPED_RELEASE = 0x80
 };
 
-static uint8_t read_u8 (FILE* f) {
-    int c = fgetc(f);
-    if (c == EOF) {
-        printf("File too short.\n");
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define NATIVE_LE16 1
+#else
+#define NATIVE_LE16 0
+#endif
+
+ // Bounds-checked reading from a file in memory
+typedef struct Reader {
+    const uint8_t* p;
+    const uint8_t* end;
+    const char* filename;
+} Reader;
+
+static const uint8_t* read_bytes (Reader* r, uint32_t size) {
+    if ((size_t)(r->end - r->p) < size) {
+        printf("File too short: %s\n", r->filename);
         exit(1);
     }
-    return c;
+    const uint8_t* got = r->p;
+    r->p += size;
+    return got;
 }
 
-static uint16_t read_u16 (FILE* f) {
-    uint16_t r = read_u8(f);
-    r |= read_u8(f) << 8;
-    return r;
+static uint8_t read_u8 (Reader* r) {
+    return *read_bytes(r, 1);
 }
 
-static uint32_t read_u32 (FILE* f) {
-    uint32_t r = read_u8(f);
-    r |= read_u8(f) << 8;
-    r |= read_u8(f) << 16;
-    r |= read_u8(f) << 24;
-    return r;
+static uint16_t read_u16 (Reader* r) {
+    const uint8_t* b = read_bytes(r, 2);
+    return b[0] | b[1] << 8;
 }
 
-static uint8_t* read_size (FILE* f, uint32_t size) {
-    uint8_t* data = malloc(size);
-    int got = fread(data, 1, size, f);
-    if (got != size) {
-        free(data);
-        printf("File too short.\n");
-        exit(1);
-    }
-    return data;
+static uint32_t read_u32 (Reader* r) {
+    const uint8_t* b = read_bytes(r, 4);
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
 }
-static void read_copy (FILE* f, uint32_t size, char* dest) {
-    int got = fread(dest, 1, size, f);
-    if (got != size) {
-        printf("File too short.\n");
-        exit(1);
-    }
+
+static void read_copy (Reader* r, uint32_t size, char* dest) {
+    memcpy(dest, read_bytes(r, size), size);
+}
+
+static void skip (Reader* r, uint32_t size) {
+    read_bytes(r, size);
 }
 
-static void skip (FILE* f, uint32_t size) {
+static void require (Reader* r, uint32_t size, const char* str) {
+    const uint8_t* got = read_bytes(r, size);
     for (uint32_t i = 0; i < size; i++) {
-        if (fgetc(f) == EOF) {
-            printf("File too short.\n");
+        if (got[i] != (uint8_t)str[i]) {
+            printf("File is incorrect: expected 0x%02hhX but got 0x%02hhX\n", (uint8_t)str[i], got[i]);
             exit(1);
         }
     }
 }
 
-static void require (FILE* f, uint32_t size, const char* str) {
-    for (const char* p = str; p < str+size; p++) {
-        uint8_t got = read_u8(f);
-        if (got != (uint8_t)*p) {
-            printf("File is incorrect: expected 0x%02hhX but got 0x%02hhX\n", (uint8_t)*p, got);
-            exit(1);
+ // Converts little-endian samples in place, in one pass that GCC vectorizes.
+static void convert_samples (int16_t* data, uint32_t n, int is_unsigned) {
+    uint16_t flip = is_unsigned ? 0x8000 : 0;
+#if NATIVE_LE16
+    if (!flip) return;
+    for (uint32_t i = 0; i < n; i++) {
+        data[i] ^= flip;
+    }
+#else
+    uint8_t* bytes = (uint8_t*)data;
+    for (uint32_t i = 0; i < n; i++) {
+        data[i] = (int16_t)((bytes[2*i] | bytes[2*i+1] << 8) ^ flip);
+    }
+#endif
+}
+
+ // Copy a sample's data into its own aligned buffer with guard frames on
+ //  both sides.  Reversed samples are flipped, and ping-pong loops are
+ //  unrolled into a forward loop, so the player only ever plays forward.
+static void prepare_sample (MDV_Sample* s, const uint8_t* raw, uint8_t sampling_modes) {
+    uint32_t n = s->data_size;
+    int64_t end = (int64_t)n << 32;
+    if (s->loop_end > end) s->loop_end = end;
+    if (s->loop_start > s->loop_end) s->loop_start = s->loop_end;
+    if (sampling_modes & REVERSE) {
+        int64_t loop_start = s->loop_start;
+        s->loop_start = end - s->loop_end;
+        s->loop_end = end - loop_start;
+    }
+     // The loop gets mirrored around its end, which has to be on a frame.
+     //  Whatever's after the loop is never played, so it gets overwritten.
+    uint32_t size = n;
+    uint32_t pp_start = (s->loop_start + 0x80000000LL) >> 32;
+    uint32_t pp_end = (s->loop_end + 0x80000000LL) >> 32;
+    int unroll = s->pingpong && pp_end > pp_start;
+    if (unroll) {
+        size = 2 * pp_end - pp_start;
+        s->loop_start = (int64_t)pp_start << 32;
+        s->loop_end = (int64_t)size << 32;
+    }
+    void* buf;
+     // Room for the guard before, and for the loop to run on for two guards'
+     //  worth past its end
+    uint32_t alloc = (size > n ? size : n) + 3 * MDV_SAMPLE_GUARD;
+    if (posix_memalign(&buf, 64, alloc * sizeof(int16_t)) != 0) {
+        fprintf(stderr, "Could not allocate sample data\n");
+        exit(1);
+    }
+    int16_t* data = (int16_t*)buf + MDV_SAMPLE_GUARD;
+    memcpy(data, raw, n * sizeof(int16_t));
+    convert_samples(data, n, sampling_modes & UNSIGNED);
+    if (sampling_modes & REVERSE) {
+        for (uint32_t i = 0; i < n / 2; i++) {
+            int16_t tmp = data[i];
+            data[i] = data[n - 1 - i];
+            data[n - 1 - i] = tmp;
+        }
+    }
+    if (unroll) {
+        if (pp_end == n)
+            data[pp_end] = data[pp_end - 1];
+        for (uint32_t j = 1; pp_end + j < size; j++) {
+            data[pp_end + j] = data[pp_end - j];
+        }
+    }
+    s->data = data;
+     // Interpolation reads frames on both sides of where it plays.  Nothing
+     //  plays past loop_end (loops wrap there and one-shot notes stop), so
+     //  whatever's after it is replaced by the loop carrying on.  Then the
+     //  loop is moved a guard later, so the frames before its start are the
+     //  same as the ones before its end, and reads across the wrap are
+     //  seamless both ways.
+    memset(data - MDV_SAMPLE_GUARD, 0, MDV_SAMPLE_GUARD * sizeof(int16_t));
+    int64_t loop_len = (s->loop_end - s->loop_start + 0x80000000LL) >> 32;
+    if (loop_len > 0) {
+        uint32_t loop_end = (s->loop_end + 0xffffffffLL) >> 32;
+        for (uint32_t i = loop_end; i < loop_end + 2 * MDV_SAMPLE_GUARD; i++) {
+            data[i] = data[i - loop_len];
+        }
+        s->loop_start += (int64_t)MDV_SAMPLE_GUARD << 32;
+        s->loop_end += (int64_t)MDV_SAMPLE_GUARD << 32;
+        size = loop_end + MDV_SAMPLE_GUARD;
+    }
+    else memset(data + size, 0, MDV_SAMPLE_GUARD * sizeof(int16_t));
+    s->data_size = size;
+}
+
+ // Which sample plays each note.  The frequency is worked out exactly like
+ //  get_freq in the player, so notes on a boundary go the same way.
+static void build_note_samples (MDV_Patch* pat) {
+    for (uint32_t note = 0; note < 128; note++) {
+        uint32_t fraction = note * 0x10000 / 12 % 0x10000;
+        uint32_t i = fraction * 4096 / 0x10000;
+        uint32_t base = 440 * 0x10000 * pow(2.0, ((i*12.0/4096) - 69) / 12.0);
+        uint32_t freq = base << (note / 12);
+        pat->note_samples[note] = 0;
+        for (uint8_t j = 0; j < pat->n_samples; j++) {
+            if (pat->samples[j].high_freq > freq) {
+                pat->note_samples[note] = j;
+                break;
+            }
         }
     }
 }
 
 MDV_Patch* mdv_patch_load (const char* filename) {
-    FILE* f = fopen(filename, "r");
-    if (!f) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         printf("Couldn't open %s for reading: %s\n", filename, strerror(errno));
         exit(1);
     }
-    require(f, 9, "GF1PATCH1");
-    skip(f, 1);
-    require(f, 12, "0\x00ID#000002\x00");
-    skip(f, 60);  // Description
-    if (read_u8(f) > 1) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Couldn't stat %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+     // Read the whole thing at once.  Samples get copied out of it.
+    size_t size = st.st_size;
+    uint8_t* file = malloc(size);
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, file + got, size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("Couldn't read from %s: %s\n", filename, n ? strerror(errno) : "File too short.");
+            exit(1);
+        }
+        got += n;
+    }
+    close(fd);
+    Reader r = {file, file + size, filename};
+
+    require(&r, 9, "GF1PATCH1");
+    skip(&r, 1);
+    require(&r, 12, "0\x00ID#000002\x00");
+    skip(&r, 60);  // Description
+    if (read_u8(&r) > 1) {
         printf("Pat has too many instruments\n");
         exit(1);
     }
-    skip(f, 1);  // Voices?
-    skip(f, 1);  // Channels?
-    skip(f, 2);  // Waveforms?
+    skip(&r, 1);  // Voices?
+    skip(&r, 1);  // Channels?
+    skip(&r, 2);  // Waveforms?
     MDV_Patch* pat = malloc(sizeof(MDV_Patch));
+    pat->refs = 1;
+    pat->source = NULL;
+    pat->mapped = 0;
+    pat->block = NULL;
+    pat->block_size = 0;
     pat->samples = NULL;
     pat->note = -1;
     pat->keep_envelope = 0;
     pat->keep_loop = 0;
-    pat->volume = read_u16(f);
-    skip(f, 4);  // Data size
-    skip(f, 36);  // Reserved
-    if (read_u16(f) != 0) {
+    pat->volume = read_u16(&r);
+    skip(&r, 4);  // Data size
+    skip(&r, 36);  // Reserved
+    if (read_u16(&r) != 0) {
         printf("Instrument ID (?) was not 0x0000 in %s\n", filename);
         goto fail;
     }
     char name [16];
-    read_copy(f, 16, name);
-    skip(f, 4);  // Instrument size
-    if (read_u8(f) != 1) {
+    read_copy(&r, 16, name);
+    skip(&r, 4);  // Instrument size
+    if (read_u8(&r) != 1) {
         printf("Instrument has too many layers (?) in %s\n", filename);
         goto fail;
     }
-    skip(f, 40);  // Reserved
-    if (read_u8(f) != 0) {
+    skip(&r, 40);  // Reserved
+    if (read_u8(&r) != 0) {
         printf("Layer duplicate (?) not 0 (?) in %s\n", filename);
         goto fail;
     }
-    if (read_u8(f) != 0) {
+    if (read_u8(&r) != 0) {
         printf("Layer ID (?) not 0 (?) in %s\n", filename);
         goto fail;
     }
-    skip(f, 4);  // Layer size
-    pat->n_samples = read_u8(f);
-    skip(f, 40);  // Reserved
+    skip(&r, 4);  // Layer size
+    pat->n_samples = read_u8(&r);
+    skip(&r, 40);  // Reserved
     pat->samples = malloc(pat->n_samples * sizeof(MDV_Sample));
     for (uint8_t i = 0; i < pat->n_samples; i++) {
         pat->samples[i].data = NULL;
     }
     for (uint8_t i = 0; i < pat->n_samples; i++) {
         char wave_name [7];
-        read_copy(f, 7, wave_name);
-        uint8_t fractions = read_u8(f);
-        pat->samples[i].data_size = read_u32(f) / 2;
-        pat->samples[i].loop_start = read_u32(f) * 0x100000000LL
+        read_copy(&r, 7, wave_name);
+        uint8_t fractions = read_u8(&r);
+        pat->samples[i].data_size = read_u32(&r) / 2;
+        pat->samples[i].loop_start = read_u32(&r) * 0x100000000LL
                                    + (fractions & 0xf) * 0x010000000LL;
         pat->samples[i].loop_start /= 2;
-        pat->samples[i].loop_end = read_u32(f) * 0x100000000LL
+        pat->samples[i].loop_end = read_u32(&r) * 0x100000000LL
                                    + ((fractions >> 4) & 0xf) * 0x010000000LL;
         pat->samples[i].loop_end /= 2;
-        pat->samples[i].sample_inc = read_u16(f) * 0x100000000LL / MDV_SAMPLE_RATE;
-        pat->samples[i].low_freq = read_u32(f) * 0x10000LL / 1000;
-        pat->samples[i].high_freq = read_u32(f) * 0x10000LL / 1000;
-        pat->samples[i].root_freq = read_u32(f) * 0x10000LL / 1000;
-        skip(f, 2);  // Tune
-        pat->samples[i].pan = read_u8(f);
+        pat->samples[i].sample_rate = read_u16(&r);
+        pat->samples[i].low_freq = read_u32(&r) * 0x10000LL / 1000;
+        pat->samples[i].high_freq = read_u32(&r) * 0x10000LL / 1000;
+        pat->samples[i].root_freq = read_u32(&r) * 0x10000LL / 1000;
+        skip(&r, 2);  // Tune
+        pat->samples[i].pan = read_u8(&r);
          // These formulas are pretty much stolen from TiMidity,
          //  which uses 15:15 (?) fixed-point format, so we'll just
-         //  go ahead and copy that for now.
+         //  go ahead and copy that for now.  The player does the rest.
         for (uint32_t j = 0; j < 6; j++) {
-            uint8_t byte = read_u8(f);
-            uint32_t val = (uint32_t)(byte & 0x3f) << (3 * (3 - ((byte >> 6) & 3)));
-            pat->samples[i].envelope_rates[j] = (val * 44100 / MDV_SAMPLE_RATE) << 9;
+            uint8_t byte = read_u8(&r);
+            pat->samples[i].envelope_rates[j] = (uint32_t)(byte & 0x3f) << (3 * (3 - ((byte >> 6) & 3)));
         }
         for (uint32_t j = 0; j < 6; j++) {
-            pat->samples[i].envelope_offsets[j] = read_u8(f) << 22;
+            pat->samples[i].envelope_offsets[j] = read_u8(&r) << 22;
         }
          // Tremolo and vibrato.
-         // These 38s are an arbitrary scaling factor copied from Timidity
-         // Increasing them makes tremolo and vibrato go slower
-        uint32_t trs = read_u8(f);
-        pat->samples[i].tremolo_sweep_inc = !trs ? 0 :
-            (38 * 0x1000000) / (MDV_SAMPLE_RATE * trs);
-        uint32_t trp = read_u8(f);
-        pat->samples[i].tremolo_phase_inc =
-            (trp * 0x1000000) / (38 * MDV_SAMPLE_RATE);
-        pat->samples[i].tremolo_depth = read_u8(f);
-        uint32_t vbs = read_u8(f);
-        pat->samples[i].vibrato_sweep_inc = !vbs ? 0 :
-            (38 * 0x1000000) / (MDV_SAMPLE_RATE * vbs);
-        uint32_t vbr = read_u8(f);
-        pat->samples[i].vibrato_phase_inc =
-            (vbr * 0x1000000) / (38 * MDV_SAMPLE_RATE);
-        pat->samples[i].vibrato_depth = read_u8(f);
-
-        uint8_t sampling_modes = read_u8(f);
-        pat->samples[i].scale_note = read_u16(f);
-        pat->samples[i].scale_factor = read_u16(f);
-        skip(f, 36);  // Reserved
-        pat->samples[i].data = (int16_t*)read_size(f, pat->samples[i].data_size * 2);
+        pat->samples[i].tremolo_sweep = read_u8(&r);
+        pat->samples[i].tremolo_rate = read_u8(&r);
+        pat->samples[i].tremolo_depth = read_u8(&r);
+        pat->samples[i].vibrato_sweep = read_u8(&r);
+        pat->samples[i].vibrato_rate = read_u8(&r);
+        pat->samples[i].vibrato_depth = read_u8(&r);
+
+        uint8_t sampling_modes = read_u8(&r);
+        pat->samples[i].scale_note = read_u16(&r);
+        pat->samples[i].scale_factor = read_u16(&r);
+        skip(&r, 36);  // Reserved
         if (!(sampling_modes & BITS16)) {
             printf("8-bit samples NYI\n");
             goto fail;
         }
-        if (sampling_modes & UNSIGNED) {
-            for (uint32_t j = 0; j < pat->samples[i].data_size; j++) {
-                pat->samples[i].data[j] ^= 0x8000;
-            }
-        }
         pat->samples[i].loop = !!(sampling_modes & LOOPING);
         pat->samples[i].pingpong = !!(sampling_modes & PINGPONG);
         pat->samples[i].sustain = !!(sampling_modes & SUSTAIN);
-        if (sampling_modes & REVERSE) {
-            printf("reverse samples NYI in %s\n", filename);
-            goto fail;
-        }
+        const uint8_t* raw = read_bytes(&r, pat->samples[i].data_size * 2);
+        prepare_sample(&pat->samples[i], raw, sampling_modes);
     }
-    fclose(f);
+    build_note_samples(pat);
+    free(file);
     return pat;
 
   fail:
-    fclose(f);
     mdv_patch_free(pat);
     exit(1);
 }
 
+MDV_Patch* mdv_patch_ref (MDV_Patch* pat) {
+    if (pat)
+        __atomic_add_fetch(&pat->refs, 1, __ATOMIC_RELAXED);
+    return pat;
+}
+
+MDV_Patch* mdv_patch_variant (MDV_Patch* source) {
+    MDV_Patch* pat = malloc(sizeof(MDV_Patch));
+    *pat = *source;
+    pat->refs = 1;
+    pat->mapped = 0;
+     // Always point at the patch that really owns the samples
+    pat->source = mdv_patch_ref(source->source ? source->source : source);
+    return pat;
+}
+
 void mdv_patch_free (MDV_Patch* pat) {
     if (!pat) return;
-    if (pat->samples) {
+    if (__atomic_sub_fetch(&pat->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if (pat->source) {
+         // If this lives inside its source's bank file, freeing the source
+         //  may unmap it.
+        if (pat->mapped) {
+            mdv_patch_free(pat->source);
+            return;
+        }
+        mdv_patch_free(pat->source);
+    }
+    else if (pat->mapped) {
+        munmap(pat->block, pat->block_size);
+    }
+    else if (pat->samples) {
         for (uint32_t i = 0; i < pat->n_samples; i++) {
             if (pat->samples[i].data)
-                free(pat->samples[i].data);
+                free(pat->samples[i].data - MDV_SAMPLE_GUARD);
         }
         free(pat->samples);
     }
@@ -241,7 +386,7 @@ void mdv_patch_print (MDV_Patch* pat) {
         printf("    pan: %hhu\n", pat->samples[i].pan);
         printf("    loop: %hhu\n", pat->samples[i].loop);
         printf("    pingpong: %hhu\n", pat->samples[i].pingpong);
-        printf("    sample_inc: %llu\n", (long long unsigned)pat->samples[i].sample_inc);
+        printf("    sample_rate: %u\n", pat->samples[i].sample_rate);
         printf("    data_size: %u\n", pat->samples[i].data_size);
         printf("    A bit of data: %04hx %04hx %04hx %04hx %04hx %04hx %04hx %04hx\n",
             pat->samples[i].data[0], pat->samples[i].data[1],
@@ -302,16 +447,122 @@ static int cmp_strs (char* a, size_t as, const char* b, size_t bs) {
     return as == bs && strncmp(a, b, as) == 0;
 }
 
-static uint32_t line;
-static char* line_begin;
-
-static void line_break (char** p, char* end) {
+static void line_break (char** p, char* end, uint32_t* line, char** line_begin) {
     require_char(p, end, '\n');
-    line += 1;
-    line_begin = *p;
+    *line += 1;
+    *line_begin = *p;
 }
 
-void mdv_load_config (MDV_Player* player, const char* cfg) {
+enum Entry_State {
+    UNLOADED,
+    REQUESTED,
+    LOADED
+};
+
+ // One line of the .cfg
+typedef struct Library_Entry {
+    uint8_t drumset;
+    uint8_t bank;
+    uint8_t program;
+    uint8_t state;
+     // Options
+    uint8_t has_options;
+    uint8_t keep_loop;
+    uint8_t keep_envelope;
+    int8_t note;
+    int32_t amp;
+    uint32_t file;
+     // NULL until loaded
+    MDV_Patch* patch;
+} Library_Entry;
+
+ // Each .pat file is only loaded once, no matter how many entries use it.
+typedef struct Library_File {
+    char* filename;
+    MDV_Patch* patch;
+} Library_File;
+
+struct MDV_Patch_Library {
+    uint32_t refs;
+    uint32_t n_entries;
+    Library_Entry* entries;
+    uint32_t n_files;
+    Library_File* files;
+     // [drumset][bank][program], with unused banks NULL
+    Library_Entry** lookup [2][128];
+     // Only for indexed libraries
+    int lazy;
+    int quit;
+    uint32_t pending;
+    pthread_t loader;
+    sem_t requests;
+    pthread_mutex_t mutex;
+    pthread_cond_t loaded;
+};
+
+ // Only touches files from one thread at a time: either the loading thread
+ //  for indexed libraries, or the caller of mdv_load_patch_library.
+static void load_entry (MDV_Patch_Library* lib, Library_Entry* e) {
+    Library_File* file = &lib->files[e->file];
+    if (!file->patch)
+        file->patch = mdv_patch_load(file->filename);
+     // Options get their own variant of the patch, so the loaded one stays
+     //  untouched for other entries.
+    MDV_Patch* patch;
+    if (e->has_options) {
+        patch = mdv_patch_variant(file->patch);
+        patch->volume = patch->volume * e->amp / 100;
+        if (e->note >= 0)
+            patch->note = e->note;
+        if (e->keep_loop)
+            patch->keep_loop = 1;
+        if (e->keep_envelope)
+            patch->keep_envelope = 1;
+    }
+    else patch = mdv_patch_ref(file->patch);
+    __atomic_store_n(&e->patch, patch, __ATOMIC_RELEASE);
+    __atomic_store_n(&e->state, LOADED, __ATOMIC_RELEASE);
+}
+
+static void* loader_thread (void* lib_) {
+    MDV_Patch_Library* lib = (MDV_Patch_Library*)lib_;
+    for (;;) {
+        sem_wait(&lib->requests);
+        if (__atomic_load_n(&lib->quit, __ATOMIC_ACQUIRE))
+            break;
+        for (uint32_t i = 0; i < lib->n_entries; i++) {
+            Library_Entry* e = &lib->entries[i];
+            if (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) == REQUESTED) {
+                load_entry(lib, e);
+                pthread_mutex_lock(&lib->mutex);
+                __atomic_sub_fetch(&lib->pending, 1, __ATOMIC_ACQ_REL);
+                pthread_cond_broadcast(&lib->loaded);
+                pthread_mutex_unlock(&lib->mutex);
+            }
+        }
+    }
+    return NULL;
+}
+
+ // Later entries override earlier ones
+static void build_lookup (MDV_Patch_Library* lib) {
+    for (uint32_t d = 0; d < 2; d++)
+    for (uint32_t b = 0; b < 128; b++)
+        lib->lookup[d][b] = NULL;
+    for (uint32_t i = 0; i < lib->n_entries; i++) {
+        Library_Entry* e = &lib->entries[i];
+        Library_Entry*** table = &lib->lookup[e->drumset][e->bank];
+        if (!*table) {
+            *table = malloc(128 * sizeof(Library_Entry*));
+            for (uint32_t j = 0; j < 128; j++)
+                (*table)[j] = NULL;
+        }
+        (*table)[e->program] = e;
+    }
+}
+
+ // Reads the .cfg, but doesn't load any patches
+static MDV_Patch_Library* index_cfg (const char* cfg) {
     int32_t prefix = -1;
     for (int32_t i = 0; cfg[i]; i++) {
         if (cfg[i] == '/') prefix = i + 1;
@@ -335,8 +586,19 @@ void mdv_load_config (MDV_Player* player, const char* cfg) {
     }
     char* p = dat;
     char* end = dat + size;
-    line = 1;
-    line_begin = dat;
+     // For error messages
+    uint32_t line = 1;
+    char* line_begin = dat;
+
+    MDV_Patch_Library* lib = malloc(sizeof(MDV_Patch_Library));
+    lib->refs = 1;
+    lib->lazy = 0;
+    uint32_t max_entries = 256;
+    lib->n_entries = 0;
+    lib->entries = malloc(max_entries * sizeof(Library_Entry));
+    uint32_t max_files = 256;
+    lib->n_files = 0;
+    lib->files = malloc(max_files * sizeof(Library_File));
 
     uint32_t bank = 0;
     int drumset = 0;
@@ -359,8 +621,12 @@ void mdv_load_config (MDV_Player* player, const char* cfg) {
                 fprintf(stderr, "Unrecognized command beginning with '%c'\n", *word);
                 exit(1);
             }
+            if (bank > 127) {
+                fprintf(stderr, "Invalid bank number: %u at %u:%lu\n", bank, line, p - line_begin);
+                exit(1);
+            }
             skip_ws(&p, end);
-            line_break(&p, end);
+            line_break(&p, end, &line, &line_begin);
         }
         else if (isdigit(*p)) {
             int32_t program = read_i32(&p, end);
@@ -368,14 +634,43 @@ void mdv_load_config (MDV_Player* player, const char* cfg) {
                 fprintf(stderr, "Invalid program number: %d at %u:%lu (%lu)\n", program, line, p - line_begin, p - dat);
                 exit(1);
             }
+            if (lib->n_entries >= max_entries) {
+                max_entries *= 2;
+                lib->entries = realloc(lib->entries, max_entries * sizeof(Library_Entry));
+            }
+            Library_Entry* e = &lib->entries[lib->n_entries++];
+            e->drumset = drumset;
+            e->bank = bank;
+            e->program = program;
+            e->state = UNLOADED;
+            e->has_options = 0;
+            e->keep_loop = 0;
+            e->keep_envelope = 0;
+            e->note = -1;
+            e->amp = 100;
+            e->patch = NULL;
             skip_ws(&p, end);
             char* word = read_word(&p, end);
             char* filename = malloc(prefix + (p - word) + 5);
             memcpy(filename, cfg, prefix);
             memcpy(filename + prefix, word, p - word);
             memcpy(filename + prefix + (p - word), ".pat", 5);
-            MDV_Patch* patch = mdv_patch_load(filename);
-            free(filename);
+            for (e->file = 0; e->file < lib->n_files; e->file++) {
+                if (strcmp(lib->files[e->file].filename, filename) == 0)
+                    break;
+            }
+            if (e->file < lib->n_files) {
+                free(filename);
+            }
+            else {
+                if (lib->n_files >= max_files) {
+                    max_files *= 2;
+                    lib->files = realloc(lib->files, max_files * sizeof(Library_File));
+                }
+                lib->files[lib->n_files].filename = filename;
+                lib->files[lib->n_files].patch = NULL;
+                lib->n_files += 1;
+            }
             skip_ws(&p, end);
             while (p != end && *p != '\n') {
                 char* option = read_word(&p, end);
@@ -383,23 +678,23 @@ void mdv_load_config (MDV_Player* player, const char* cfg) {
                 skip_ws(&p, end);
                 require_char(&p, end, '=');
                 skip_ws(&p, end);
+                e->has_options = 1;
                 if (cmp_strs(option, opt_len, "amp", 3)) {
-                    int32_t percent = read_i32(&p, end);
-                    patch->volume = patch->volume * percent / 100;
+                    e->amp = e->amp * read_i32(&p, end) / 100;
                 }
                 else if (cmp_strs(option, opt_len, "note", 4)) {
                     int32_t note = read_i32(&p, end);
                     if (note >= 0 && note <= 127) {
-                        patch->note = note;
+                        e->note = note;
                     }
                 }
                 else if (cmp_strs(option, opt_len, "keep", 4)) {
                     char* keep = read_word(&p, end);
                     if (cmp_strs(keep, p - keep, "loop", 4)) {
-                        patch->keep_loop = 1;
+                        e->keep_loop = 1;
                     }
                     else if (cmp_strs(keep, p - keep, "env", 3)) {
-                        patch->keep_envelope = 1;
+                        e->keep_envelope = 1;
                     }
                 }
                 else {
@@ -407,14 +702,10 @@ void mdv_load_config (MDV_Player* player, const char* cfg) {
                 }
                 skip_ws(&p, end);
             }
-            if (drumset)
-                mdv_set_drum(player, bank, program, patch);
-            else
-                mdv_set_patch(player, bank, program, patch);
-            line_break(&p, end);
+            line_break(&p, end, &line, &line_begin);
         }
         else if (*p == '\n') {
-            line_break(&p, end);
+            line_break(&p, end, &line, &line_begin);
         }
         else {
             fprintf(stderr, "Parse error: Unexpected char \\x%02hhX at %u:%lu\n", *p, line, p - line_begin);
@@ -423,4 +714,453 @@ void mdv_load_config (MDV_Player* player, const char* cfg) {
         skip_ws(&p, end);
     }
     free(dat);
+    build_lookup(lib);
+    return lib;
+}
+
+MDV_Patch_Library* mdv_load_patch_library (const char* cfg) {
+    MDV_Patch_Library* lib = index_cfg(cfg);
+    for (uint32_t i = 0; i < lib->n_entries; i++)
+        load_entry(lib, &lib->entries[i]);
+    return lib;
+}
+
+MDV_Patch_Library* mdv_index_patch_library (const char* cfg) {
+    MDV_Patch_Library* lib = index_cfg(cfg);
+    lib->lazy = 1;
+    lib->quit = 0;
+    lib->pending = 0;
+    sem_init(&lib->requests, 0, 0);
+    pthread_mutex_init(&lib->mutex, NULL);
+    pthread_cond_init(&lib->loaded, NULL);
+    if (pthread_create(&lib->loader, NULL, loader_thread, lib) != 0) {
+        fprintf(stderr, "Could not start patch loading thread\n");
+        exit(1);
+    }
+    return lib;
+}
+
+MDV_Patch* mdv_library_patch (MDV_Patch_Library* lib, int drumset, uint8_t bank, uint8_t program, int* pending) {
+    *pending = 0;
+    if (bank > 127 || program > 127) return NULL;
+    Library_Entry** table = lib->lookup[!!drumset][bank];
+    Library_Entry* e = table ? table[program] : NULL;
+    if (!e) return NULL;
+    MDV_Patch* patch = __atomic_load_n(&e->patch, __ATOMIC_ACQUIRE);
+    if (patch) return patch;
+     // Only the first request for an entry wakes up the loader.  It's counted
+     //  before it's published, so the loader can't finish it and take it off
+     //  the count first, and waiters never see it uncounted.
+    if (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) == UNLOADED) {
+        __atomic_add_fetch(&lib->pending, 1, __ATOMIC_ACQ_REL);
+        uint8_t expected = UNLOADED;
+        if (__atomic_compare_exchange_n(&e->state, &expected, REQUESTED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            sem_post(&lib->requests);
+        }
+         // Another thread got there first, so take this back.  Someone may
+         //  be waiting on it.
+        else if (__atomic_sub_fetch(&lib->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&lib->mutex);
+            pthread_cond_broadcast(&lib->loaded);
+            pthread_mutex_unlock(&lib->mutex);
+        }
+    }
+    *pending = 1;
+    return NULL;
+}
+
+void mdv_prefetch_sequence (MDV_Patch_Library* lib, MDV_Sequence* seq) {
+    uint8_t banks [16] = {0};
+    int pending;
+    for (uint32_t i = 0; i < seq->n_events; i++) {
+        MDV_Event* ev = &seq->events[i].event;
+        if (ev->channel >= 16) continue;
+        switch (ev->type) {
+            case MDV_CONTROLLER:
+                if (ev->param1 == MDV_BANK_SELECT)
+                    banks[ev->channel] = ev->param2;
+                break;
+            case MDV_PROGRAM_CHANGE:
+                if (ev->channel != 9)
+                    mdv_library_patch(lib, 0, banks[ev->channel], ev->param1, &pending);
+                break;
+            case MDV_NOTE_ON:
+                if (ev->channel == 9 && ev->param2)
+                    mdv_library_patch(lib, 1, banks[ev->channel], ev->param1, &pending);
+                break;
+            default: break;
+        }
+    }
+}
+
+void mdv_wait_patch_library (MDV_Patch_Library* lib) {
+    if (!lib->lazy) return;
+    pthread_mutex_lock(&lib->mutex);
+    while (__atomic_load_n(&lib->pending, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&lib->loaded, &lib->mutex);
+    pthread_mutex_unlock(&lib->mutex);
+}
+
+MDV_Patch_Library* mdv_patch_library_ref (MDV_Patch_Library* lib) {
+    if (lib)
+        __atomic_add_fetch(&lib->refs, 1, __ATOMIC_RELAXED);
+    return lib;
+}
+
+void mdv_free_patch_library (MDV_Patch_Library* lib) {
+    if (!lib) return;
+    if (__atomic_sub_fetch(&lib->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if (lib->lazy) {
+        __atomic_store_n(&lib->quit, 1, __ATOMIC_RELEASE);
+        sem_post(&lib->requests);
+        pthread_join(lib->loader, NULL);
+        pthread_cond_destroy(&lib->loaded);
+        pthread_mutex_destroy(&lib->mutex);
+        sem_destroy(&lib->requests);
+    }
+    for (uint32_t i = 0; i < lib->n_entries; i++)
+        mdv_patch_free(lib->entries[i].patch);
+    free(lib->entries);
+    for (uint32_t i = 0; i < lib->n_files; i++) {
+        free(lib->files[i].filename);
+        mdv_patch_free(lib->files[i].patch);
+    }
+    free(lib->files);
+    for (uint32_t d = 0; d < 2; d++)
+    for (uint32_t b = 0; b < 128; b++)
+        free(lib->lookup[d][b]);
+    free(lib);
+}
+
+void mdv_load_config (MDV_Player* player, const char* cfg) {
+    MDV_Patch_Library* lib = mdv_load_patch_library(cfg);
+    mdv_use_patch_library(player, lib);
+    mdv_free_patch_library(lib);
+}
+
+ // A bank file is a compiled .cfg: the library's lookup tables, its patches
+ //  and samples as the structs themselves, and aligned sample data, laid out as
+ //  header | sources | entries | patches | samples | names | data
+ // Pointers are stored as offsets into the file and fixed up after mapping, so
+ //  a bank only works with the same build that wrote it.
+
+#define BANK_VERSION 4
+#define BANK_ALIGN 64
+
+typedef struct Bank_Header {
+    char magic [8];
+    uint32_t version;
+    uint32_t patch_size;
+    uint32_t sample_size;
+    uint32_t n_sources;
+    uint32_t n_entries;
+    uint32_t n_patches;
+    uint32_t n_samples;
+     // Offsets
+    uint64_t sources;
+    uint64_t entries;
+    uint64_t patches;
+    uint64_t samples;
+    uint64_t size;
+} Bank_Header;
+
+ // A file the bank was compiled from, so we can tell if it's out of date
+typedef struct Bank_Source {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t name;
+} Bank_Source;
+
+typedef struct Bank_Entry {
+    uint8_t drumset;
+    uint8_t bank;
+    uint8_t program;
+    uint8_t unused;
+    uint32_t patch;
+} Bank_Entry;
+
+static const char bank_magic [8] = "MDVBANK";
+
+static uint64_t bank_align (uint64_t off) {
+    return (off + BANK_ALIGN - 1) / BANK_ALIGN * BANK_ALIGN;
+}
+
+static int stat_source (const char* filename, Bank_Source* src) {
+    struct stat st;
+    if (stat(filename, &st) != 0) return 0;
+    src->size = st.st_size;
+    src->mtime_sec = st.st_mtim.tv_sec;
+    src->mtime_nsec = st.st_mtim.tv_nsec;
+    return 1;
+}
+
+int mdv_compile_patch_bank (const char* cfg, const char* bank) {
+    MDV_Patch_Library* lib = mdv_load_patch_library(cfg);
+     // Entries without options share their file's patch, and variants share
+     //  their source's samples, so collect each of those once.
+    uint32_t n_patches = 0;
+    MDV_Patch** patches = malloc(lib->n_entries * sizeof(MDV_Patch*));
+    uint32_t* entry_patches = malloc(lib->n_entries * sizeof(uint32_t));
+    uint32_t n_owners = 0;
+    MDV_Patch** owners = malloc(lib->n_entries * sizeof(MDV_Patch*));
+    uint32_t* owner_samples = malloc(lib->n_entries * sizeof(uint32_t));
+    uint32_t n_samples = 0;
+    uint64_t data_size = 0;
+    for (uint32_t i = 0; i < lib->n_entries; i++) {
+        MDV_Patch* pat = lib->entries[i].patch;
+        uint32_t j;
+        for (j = 0; j < n_patches; j++)
+            if (patches[j] == pat) break;
+        if (j == n_patches)
+            patches[n_patches++] = pat;
+        entry_patches[i] = j;
+        MDV_Patch* owner = pat->source ? pat->source : pat;
+        for (j = 0; j < n_owners; j++)
+            if (owners[j] == owner) break;
+        if (j == n_owners) {
+            owners[n_owners] = owner;
+            owner_samples[n_owners++] = n_samples;
+            n_samples += owner->n_samples;
+            for (uint32_t k = 0; k < owner->n_samples; k++)
+                data_size += bank_align(
+                    (owner->samples[k].data_size + 2 * MDV_SAMPLE_GUARD) * sizeof(int16_t)
+                );
+        }
+    }
+    uint32_t n_sources = lib->n_files + 1;
+    uint64_t names_size = strlen(cfg) + 1;
+    for (uint32_t i = 0; i < lib->n_files; i++)
+        names_size += strlen(lib->files[i].filename) + 1;
+
+    Bank_Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, bank_magic, 8);
+    h.version = BANK_VERSION;
+    h.patch_size = sizeof(MDV_Patch);
+    h.sample_size = sizeof(MDV_Sample);
+    h.n_sources = n_sources;
+    h.n_entries = lib->n_entries;
+    h.n_patches = n_patches;
+    h.n_samples = n_samples;
+    h.sources = bank_align(sizeof(Bank_Header));
+    h.entries = bank_align(h.sources + n_sources * sizeof(Bank_Source));
+    h.patches = bank_align(h.entries + lib->n_entries * sizeof(Bank_Entry));
+    h.samples = bank_align(h.patches + n_patches * sizeof(MDV_Patch));
+    uint64_t names = h.samples + n_samples * sizeof(MDV_Sample);
+    uint64_t data = bank_align(names + names_size);
+    h.size = data + data_size;
+
+    uint8_t* out = calloc(h.size, 1);
+    memcpy(out, &h, sizeof(h));
+    Bank_Source* sources = (Bank_Source*)(out + h.sources);
+    for (uint32_t i = 0; i < n_sources; i++) {
+        const char* filename = i ? lib->files[i-1].filename : cfg;
+        if (!stat_source(filename, &sources[i])) {
+            fprintf(stderr, "Could not stat %s: %s\n", filename, strerror(errno));
+            goto fail;
+        }
+        sources[i].name = names;
+        memcpy(out + names, filename, strlen(filename) + 1);
+        names += strlen(filename) + 1;
+    }
+    Bank_Entry* entries = (Bank_Entry*)(out + h.entries);
+    for (uint32_t i = 0; i < lib->n_entries; i++) {
+        entries[i].drumset = lib->entries[i].drumset;
+        entries[i].bank = lib->entries[i].bank;
+        entries[i].program = lib->entries[i].program;
+        entries[i].patch = entry_patches[i];
+    }
+    MDV_Sample* samples = (MDV_Sample*)(out + h.samples);
+    for (uint32_t i = 0; i < n_owners; i++) {
+        for (uint32_t k = 0; k < owners[i]->n_samples; k++) {
+            MDV_Sample* s = &samples[owner_samples[i] + k];
+            *s = owners[i]->samples[k];
+            uint64_t guarded = (s->data_size + 2 * MDV_SAMPLE_GUARD) * sizeof(int16_t);
+            memcpy(out + data, s->data - MDV_SAMPLE_GUARD, guarded);
+            s->data = (int16_t*)(uintptr_t)(data + MDV_SAMPLE_GUARD * sizeof(int16_t));
+            data += bank_align(guarded);
+        }
+    }
+    MDV_Patch* out_patches = (MDV_Patch*)(out + h.patches);
+    for (uint32_t i = 0; i < n_patches; i++) {
+        MDV_Patch* owner = patches[i]->source ? patches[i]->source : patches[i];
+        uint32_t j;
+        for (j = 0; owners[j] != owner; j++) { }
+        MDV_Patch* p = &out_patches[i];
+        *p = *patches[i];
+        p->refs = 0;
+        p->mapped = 1;
+        p->source = NULL;
+        p->block = NULL;
+        p->block_size = 0;
+        p->samples = (MDV_Sample*)(uintptr_t)(h.samples + owner_samples[j] * sizeof(MDV_Sample));
+    }
+
+     // Write to a temporary file first so nobody maps a half-written bank
+    size_t tmp_len = strlen(bank) + 5;
+    char* tmp = malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%s.tmp", bank);
+    FILE* f = fopen(tmp, "wb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s for writing: %s\n", tmp, strerror(errno));
+        free(tmp);
+        goto fail;
+    }
+    int ok = fwrite(out, 1, h.size, f) == h.size;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, bank) != 0) {
+        fprintf(stderr, "Could not write %s: %s\n", bank, strerror(errno));
+        remove(tmp);
+        free(tmp);
+        goto fail;
+    }
+    free(tmp);
+    free(out);
+    free(owner_samples);
+    free(owners);
+    free(entry_patches);
+    free(patches);
+    mdv_free_patch_library(lib);
+    return 1;
+
+  fail:
+    free(out);
+    free(owner_samples);
+    free(owners);
+    free(entry_patches);
+    free(patches);
+    mdv_free_patch_library(lib);
+    return 0;
+}
+
+static int bank_range (const Bank_Header* h, uint64_t off, uint64_t n, uint64_t size) {
+    return off <= h->size && n <= (h->size - off) / size;
+}
+
+MDV_Patch_Library* mdv_load_patch_bank (const char* bank) {
+    int fd = open(bank, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Bank_Header)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+     // Private and writable so the pointers can be fixed up.  Only the pages
+     //  holding structs get copied; sample data stays shared with the file.
+    uint8_t* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    const Bank_Header* h = (const Bank_Header*)base;
+    if (memcmp(h->magic, bank_magic, 8) != 0
+     || h->version != BANK_VERSION
+     || h->patch_size != sizeof(MDV_Patch)
+     || h->sample_size != sizeof(MDV_Sample)
+     || h->size != size
+     || !bank_range(h, h->sources, h->n_sources, sizeof(Bank_Source))
+     || !bank_range(h, h->entries, h->n_entries, sizeof(Bank_Entry))
+     || !bank_range(h, h->patches, h->n_patches, sizeof(MDV_Patch))
+     || !bank_range(h, h->samples, h->n_samples, sizeof(MDV_Sample))
+    ) goto fail;
+     // Out of date if any of the files it came from changed
+    Bank_Source* sources = (Bank_Source*)(base + h->sources);
+    for (uint32_t i = 0; i < h->n_sources; i++) {
+        if (sources[i].name >= size
+         || !memchr(base + sources[i].name, 0, size - sources[i].name)
+        ) goto fail;
+        Bank_Source now;
+        if (!stat_source((const char*)base + sources[i].name, &now)
+         || now.size != sources[i].size
+         || now.mtime_sec != sources[i].mtime_sec
+         || now.mtime_nsec != sources[i].mtime_nsec
+        ) goto fail;
+    }
+    MDV_Sample* samples = (MDV_Sample*)(base + h->samples);
+    for (uint32_t i = 0; i < h->n_samples; i++) {
+        uint64_t off = (uintptr_t)samples[i].data - MDV_SAMPLE_GUARD * sizeof(int16_t);
+        if (off % sizeof(int16_t) || off > h->size
+         || !bank_range(h, off, samples[i].data_size + 2 * MDV_SAMPLE_GUARD, sizeof(int16_t))
+        ) goto fail;
+         // The player trusts these to stay inside the data, and divides by
+         //  root_freq
+        if (samples[i].root_freq == 0
+         || samples[i].loop_start < 0
+         || samples[i].loop_start > samples[i].loop_end
+         || samples[i].loop_end > (int64_t)samples[i].data_size << 32
+        ) goto fail;
+    }
+    MDV_Patch* patches = (MDV_Patch*)(base + h->patches);
+    for (uint32_t i = 0; i < h->n_patches; i++) {
+        uint64_t off = (uintptr_t)patches[i].samples;
+        if (off < h->samples
+         || (off - h->samples) % sizeof(MDV_Sample)
+         || (off - h->samples) / sizeof(MDV_Sample) + patches[i].n_samples > h->n_samples
+        ) goto fail;
+        for (uint32_t n = 0; n < 128; n++) {
+            if (patches[i].note_samples[n] >= patches[i].n_samples) goto fail;
+        }
+    }
+    Bank_Entry* entries = (Bank_Entry*)(base + h->entries);
+    for (uint32_t i = 0; i < h->n_entries; i++) {
+        if (entries[i].drumset > 1 || entries[i].bank > 127
+         || entries[i].program > 127 || entries[i].patch >= h->n_patches
+        ) goto fail;
+    }
+
+     // Everything checks out, so fix up the pointers.  The mapping belongs to
+     //  an owner patch that every patch in it holds a reference to.
+    MDV_Patch* owner = malloc(sizeof(MDV_Patch));
+    memset(owner, 0, sizeof(MDV_Patch));
+    owner->refs = h->n_patches + 1;
+    owner->note = -1;
+    owner->mapped = 1;
+    owner->block = base;
+    owner->block_size = size;
+    for (uint32_t i = 0; i < h->n_samples; i++)
+        samples[i].data = (int16_t*)(base + (uintptr_t)samples[i].data);
+    for (uint32_t i = 0; i < h->n_patches; i++) {
+        patches[i].samples = (MDV_Sample*)(base + (uintptr_t)patches[i].samples);
+        patches[i].source = owner;
+        patches[i].refs = 0;
+    }
+    MDV_Patch_Library* lib = malloc(sizeof(MDV_Patch_Library));
+    lib->refs = 1;
+    lib->lazy = 0;
+    lib->n_files = 0;
+    lib->files = NULL;
+    lib->n_entries = h->n_entries;
+    lib->entries = malloc(h->n_entries * sizeof(Library_Entry));
+    for (uint32_t i = 0; i < h->n_entries; i++) {
+        Library_Entry* e = &lib->entries[i];
+        memset(e, 0, sizeof(Library_Entry));
+        e->drumset = entries[i].drumset;
+        e->bank = entries[i].bank;
+        e->program = entries[i].program;
+        e->state = LOADED;
+        e->patch = mdv_patch_ref(&patches[entries[i].patch]);
+    }
+    build_lookup(lib);
+     // Patches nobody uses won't ever be freed, so drop their references now
+    for (uint32_t i = 0; i < h->n_patches; i++) {
+        if (!patches[i].refs)
+            mdv_patch_free(owner);
+    }
+    mdv_patch_free(owner);
+    return lib;
+
+  fail:
+    munmap(base, size);
+    return NULL;
+}
+
+MDV_Patch_Library* mdv_load_cached_patch_library (const char* cfg, const char* bank) {
+    MDV_Patch_Library* lib = mdv_load_patch_bank(bank);
+    if (!lib && mdv_compile_patch_bank(cfg, bank))
+        lib = mdv_load_patch_bank(bank);
+    if (!lib)
+        lib = mdv_load_patch_library(cfg);
+    return lib;
 }
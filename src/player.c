@@ -1,22 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
 #include "midieval.h"
 
-#define CONTROL_UPDATE_INTERVAL 16
+ // Envelopes, LFOs and pitch are updated for every voice at once, at the
+ //  start of each block of this many samples.  Volume and pitch ramp
+ //  linearly to the new values over the block.
+#define CONTROL_UPDATE_INTERVAL 32
+#define MAX_CHUNK_LENGTH 512
+ // Bus 0, one for each stem, and one for each channel with effect sends
+#define MAX_BUSES (1 + MDV_MAX_STEMS + 16)
+ // How many control updates a stolen voice takes to fade out
+#define STEAL_FADE 8
+#define DEFAULT_POLYPHONY 240
+ // Only time control updates on one block in this many
+#define CONTROL_TIMING_SAMPLE 8
+
+#ifdef MDV_NO_COUNTERS
+#define COUNTERS 0
+#else
+#define COUNTERS 1
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "player_tables.c"
+#include "player_mix.c"
+#include "player_effects.c"
+#include "player_threads.c"
 
+ // Voices are split in two parallel arrays.  This half is only used at
+ //  control updates and by events, and Voice_Mix has what's needed for every
+ //  sample, so mixing doesn't pull the rest through the cache.
 typedef struct Voice {
-    uint8_t next;
+    uint8_t channel;
     uint8_t note;
     uint8_t velocity;
-    uint8_t backwards;
     uint8_t envelope_phase;
-    uint8_t control_timer;
     uint8_t patch_volume;
     uint8_t do_envelope;
-    uint8_t do_loop;
+     // Links in player->notes, only valid if in_notes
+    uint8_t in_notes;
+    uint8_t note_prev;
+    uint8_t note_next;
+     // Control updates left before a stolen voice is silent, or 0 if it
+     //  wasn't stolen
+    uint8_t fade;
+     // Hasn't had a control update yet
+    uint8_t fresh;
+    uint32_t serial;  // For telling which voice is older
      // 15:15 (?) fixed point
     uint32_t envelope_value;
      // 8:24
@@ -25,13 +58,40 @@ typedef struct Voice {
     int32_t vibrato_sweep;
     int32_t vibrato_phase;
     uint32_t channel_volume;  // Cached so it doesn't affect ending notes
-    uint32_t volume;
-    int64_t sample_inc;
+     // The sample's increments at the player's rate, worked out at note-on
+     //  by bind_sample
+    int64_t root_inc;  // 32:32, at the sample's root frequency
+    uint32_t envelope_rates [6];
+    int32_t tremolo_sweep_inc;  // 8:24
+    int32_t tremolo_phase_inc;
+    int32_t vibrato_sweep_inc;
+    int32_t vibrato_phase_inc;
+} Voice;
+
+ // How a voice gets mixed, picked at note-on.  Samples always play forward,
+ //  since ping-pong loops are unrolled when they're loaded.
+enum Voice_Mode {
+    MODE_SILENT,  // A drum with no patch
+    MODE_SQUARE,  // No patch, so play a square wave
+    MODE_ONE_SHOT,
+    MODE_LOOP
+};
+
+typedef struct Voice_Mix {
      // 32:32 fixed point
      // Signed to make math easier
     int64_t sample_pos;
+    int64_t sample_inc;
+     // Per sample, for ramping to the next control update's values
+    int64_t inc_step;
+    float volume;
+    float volume_step;
     MDV_Sample* sample;
-} Voice;
+     // Kept in sync with the channel's pan
+    float pan_l;
+    float pan_r;
+    uint8_t mode;
+} Voice_Mix;
 
 typedef struct Channel {
      // TODO: a lot more controllers
@@ -41,14 +101,50 @@ typedef struct Channel {
     uint8_t volume;
     uint8_t expression;
     int8_t pan;
-    uint8_t voices;
     uint8_t no_envelope;  // Usually true for drum patches
     uint8_t no_loop;  // ''
     uint8_t is_drums;
     uint8_t bank;
     MDV_Patch* patch;  // Because bank changing doesn't affect this
+     // What the last program change asked for, in case its patch wasn't
+     //  loaded yet.  program is 255 if there hasn't been one.
+    uint8_t program;
+    uint8_t program_bank;
+    uint8_t patch_pending;
+    uint8_t n_live_voices;  // Not counting stolen ones fading out
+     // Effect send levels
+    uint8_t reverb;
+    uint8_t chorus;
 } Channel;
 
+ // Everything needed to pick up playback at a sample, except voices.
+ //  Patches are looked up again from program and program_bank on restore.
+typedef struct Checkpoint {
+    uint64_t sample;
+    uint32_t seq_pos;
+    Channel channels [16];
+} Checkpoint;
+
+ // How far apart checkpoints are, in seconds.  Seeking replays at most this
+ //  much.
+#define CHECKPOINT_INTERVAL 1
+
+typedef struct Queued_Event {
+    uint64_t sample;
+    MDV_Event event;
+} Queued_Event;
+
+ // A ring of live events from mdv_queue_event.  The producer only writes
+ //  tail and get_audio only writes head, each publishing its slots with
+ //  release ordering, so neither ever waits.  They're on separate cache
+ //  lines so the two threads don't fight over them.
+typedef struct Event_Queue {
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t head __attribute__((aligned(64)));
+    uint64_t clock;  // Published at the end of each get_audio
+    Queued_Event events [MDV_EVENT_QUEUE_SIZE] __attribute__((aligned(64)));
+} Event_Queue;
+
 
 struct MDV_Player {
      // Specification
@@ -56,19 +152,53 @@ struct MDV_Player {
     uint8_t n_drumsets;
     MDV_Patch*** banks;  // You read that right, three stars
     MDV_Patch*** drumsets;
-    uint32_t tick_length;
+     // Patches not set on the player itself come from here
+    MDV_Patch_Library* library;
+     // Playing from one of these
     MDV_Sequence* seq;
+    MDV_Stream* stream;
+    uint32_t sample_rate;
      // State
     uint32_t seq_pos;
-    uint32_t samples_to_tick;
-    uint32_t ticks_to_event;
+    uint64_t sample;  // Since the start of seq or stream
+     // For seeking.  The index is built for seq on the first seek.
+    Checkpoint start;
+    uint32_t n_checkpoints;
+    Checkpoint* checkpoints;
     Channel channels [16];
-    uint8_t inactive;  // inactive voices
+     // Voices by channel and note, newest first, so note-offs don't have to
+     //  search.  Voices drop out of here when
+     //  they're released, or when a note-off finds them already released.
+    uint8_t notes [16][128];
     uint8_t n_active_voices;
+     // Active voice indexes, oldest first, and then inactive ones, with the
+     //  next to be used at the end.
+    uint8_t active [255];
+    uint8_t inactive [255];
+    uint8_t n_live_voices;
+    uint32_t voice_serial;
+     // Polyphony limits, see mdv_set_polyphony
+    uint8_t polyphony;
+    uint8_t channel_polyphony [16];
+    uint8_t channel_reserve [16];
+    uint8_t channel_stem [16];
+     // Which bus each channel's voices mix into for the current chunk.  Bus
+     //  0 only goes to the master output.
+    uint8_t channel_bus [16];
+    Effects* effects;  // NULL if they're off
+    Event_Queue* queue;  // NULL in offline rendering's copies
+    MDV_Counters counters;
     Voice voices [255];
-     // Debug
-    uint64_t clip_count;
-    int32_t max_value;
+    Voice_Mix mix [255];
+    Mix_Run* mix_run;
+     // Only if rendering on multiple threads
+    Thread_Pool* pool;
+     // The chunk being mixed, MAX_BUSES buses.  Preallocated so it isn't on
+     //  the stack of the thread asking for audio.  Offline rendering gives
+     //  each thread its own.
+    int32_t(* chunks )[MAX_CHUNK_LENGTH][2];
+     // MAX_BUSES buses for each thread but the first
+    int32_t(* partial_chunks )[MAX_CHUNK_LENGTH][2];
 };
 
 void mdv_channel_set_drums (MDV_Player* p, uint8_t channel, int is_drums) {
@@ -82,61 +212,287 @@ int mdv_channel_is_drums (MDV_Player* p, uint8_t channel) {
         return 0;
 }
 
-FILE* debug_f;
+static int32_t(* alloc_chunks () )[MAX_CHUNK_LENGTH][2] {
+    void* p;
+    if (posix_memalign(&p, 64, MAX_BUSES * sizeof(int32_t[MAX_CHUNK_LENGTH][2])) != 0) {
+        fprintf(stderr, "Could not allocate mix buses\n");
+        exit(1);
+    }
+    return p;
+}
 
 MDV_Player* mdv_new_player () {
     init_tables();
-    debug_f = fopen("debug_out", "w");
     MDV_Player* player = (MDV_Player*)malloc(sizeof(MDV_Player));
     player->n_banks = 0;
     player->banks = NULL;
     player->n_drumsets = 0;
     player->drumsets = NULL;
-    player->clip_count = 0;
-    player->max_value = 0;
+    player->library = NULL;
+    player->seq = NULL;
+    player->stream = NULL;
+    player->n_checkpoints = 0;
+    player->checkpoints = NULL;
+    player->sample_rate = MDV_SAMPLE_RATE;
+    player->mix_run = select_mix_run(MDV_LINEAR);
+    player->pool = NULL;
+    player->chunks = alloc_chunks();
+    player->partial_chunks = NULL;
+    player->effects = effects_new(player->sample_rate);
+    if (posix_memalign((void**)&player->queue, 64, sizeof(Event_Queue)) != 0) {
+        fprintf(stderr, "Could not allocate event queue\n");
+        exit(1);
+    }
+    player->queue->head = 0;
+    player->queue->tail = 0;
+    player->queue->clock = 0;
+    memset(&player->counters, 0, sizeof(player->counters));
+    player->voice_serial = 0;
+    player->polyphony = DEFAULT_POLYPHONY;
+    memset(player->channel_polyphony, 255, sizeof(player->channel_polyphony));
+    memset(player->channel_reserve, 0, sizeof(player->channel_reserve));
+    for (uint8_t i = 0; i < 16; i++)
+        player->channel_stem[i] = i;
     MDV_Event reset = {MDV_COMMON, MDV_RESET, 0, 0};
     mdv_play_event(player, &reset);
     return player;
 }
 void mdv_free_player (MDV_Player* player) {
     for (uint8_t i = 0; i < player->n_banks; i++) {
+        if (!player->banks[i]) continue;
         for (uint8_t j = 0; j < 128; j++)
             mdv_patch_free(player->banks[i][j]);
         free(player->banks[i]);
     }
     free(player->banks);
     for (uint8_t i = 0; i < player->n_drumsets; i++) {
+        if (!player->drumsets[i]) continue;
         for (uint8_t j = 0; j < 128; j++)
             mdv_patch_free(player->drumsets[i][j]);
         free(player->drumsets[i]);
     }
     free(player->drumsets);
-    fprintf(stderr, "Clip count: %llu\n", (long long unsigned)player->clip_count);
-    fprintf(stderr, "Max value: %08lx\n", (long unsigned)player->max_value);
+    mdv_free_patch_library(player->library);
+    free(player->checkpoints);
+    pool_free(player->pool);
+    free(player->chunks);
+    free(player->partial_chunks);
+    effects_free(player->effects);
+    free(player->queue);
     free(player);
 }
 
+static uint8_t clamp_voices (int voices) {
+    return voices < 0 ? 0 : voices > 255 ? 255 : voices;
+}
+void mdv_set_polyphony (MDV_Player* player, int voices) {
+    player->polyphony = clamp_voices(voices);
+}
+void mdv_channel_set_polyphony (MDV_Player* player, uint8_t channel, int voices) {
+    if (channel < 16)
+        player->channel_polyphony[channel] = clamp_voices(voices);
+}
+void mdv_channel_reserve_voices (MDV_Player* player, uint8_t channel, int voices) {
+    if (channel < 16)
+        player->channel_reserve[channel] = clamp_voices(voices);
+}
+
+void mdv_channel_set_stem (MDV_Player* player, uint8_t channel, uint8_t stem) {
+    if (channel < 16 && stem < MDV_MAX_STEMS)
+        player->channel_stem[channel] = stem;
+}
+
+void mdv_set_sample_rate (MDV_Player* player, uint32_t rate) {
+    if (rate < MDV_MIN_SAMPLE_RATE) rate = MDV_MIN_SAMPLE_RATE;
+    if (rate > MDV_MAX_SAMPLE_RATE) rate = MDV_MAX_SAMPLE_RATE;
+     // Voices have increments for the old rate
+    for (uint8_t i = 0; i < 16; i++) {
+        MDV_Event e = {MDV_CONTROLLER, i, MDV_ALL_SOUND_OFF, 0};
+        mdv_play_event(player, &e);
+    }
+     // The same point in time at the new rate.  Rounding down keeps every
+     //  event that hasn't played yet in the future, so none of them is late.
+    player->sample = player->sample * rate / player->sample_rate;
+    player->sample_rate = rate;
+    if (player->effects) {
+        effects_free(player->effects);
+        player->effects = effects_new(rate);
+    }
+     // Checkpoints are in samples too, so the index has to be built again
+    free(player->checkpoints);
+    player->checkpoints = NULL;
+    player->n_checkpoints = 0;
+}
+uint32_t mdv_get_sample_rate (MDV_Player* player) {
+    return player->sample_rate;
+}
+
+void mdv_set_interpolation (MDV_Player* player, int interpolation) {
+    player->mix_run = select_mix_run(interpolation);
+}
+
+void mdv_set_effects (MDV_Player* player, int enabled) {
+    if (enabled && !player->effects)
+        player->effects = effects_new(player->sample_rate);
+    else if (!enabled) {
+        effects_free(player->effects);
+        player->effects = NULL;
+    }
+}
+
+void mdv_get_counters (MDV_Player* player, MDV_Counters* counters) {
+    *counters = player->counters;
+}
+
+void mdv_reset_counters (MDV_Player* player) {
+    memset(&player->counters, 0, sizeof(player->counters));
+}
+
+ // For the counters' stage times.  Always 0 if they're compiled out.
+static uint64_t counter_clock () {
+    if (!COUNTERS) return 0;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void mdv_set_threads (MDV_Player* player, int n_threads) {
+    pool_free(player->pool);
+    free(player->partial_chunks);
+    player->pool = NULL;
+    player->partial_chunks = NULL;
+    if (n_threads > 1) {
+        player->pool = pool_new(n_threads);
+        player->partial_chunks = malloc(
+            (n_threads - 1) * MAX_BUSES * sizeof(*player->partial_chunks)
+        );
+    }
+}
+
+ // Where mdv_seek goes back to.  Any old checkpoints are for another sequence.
+static void save_start (MDV_Player* player) {
+    Checkpoint* cp = &player->start;
+    cp->sample = 0;
+    cp->seq_pos = 0;
+    memcpy(cp->channels, player->channels, sizeof(cp->channels));
+    free(player->checkpoints);
+    player->checkpoints = NULL;
+    player->n_checkpoints = 0;
+}
+
 void mdv_play_sequence (MDV_Player* player, MDV_Sequence* seq) {
-     // Default tempo is 120bpm
-    player->tick_length = MDV_SAMPLE_RATE / seq->tpb / 2;
     player->seq = seq;
+    player->stream = NULL;
     player->seq_pos = 0;
-    player->samples_to_tick = player->tick_length;
-    player->ticks_to_event = seq->events[0].time;
+    player->sample = 0;
+    save_start(player);
+    if (player->library)
+        mdv_prefetch_sequence(player->library, seq);
+}
+
+void mdv_play_stream (MDV_Player* player, MDV_Stream* stream) {
+    player->seq = NULL;
+    player->stream = stream;
+    player->sample = 0;
+    save_start(player);
+}
+
+ // The next event from whichever of seq or stream we're playing, or NULL
+static const MDV_Timed_Event* peek_event (MDV_Player* player) {
+    if (player->stream)
+        return mdv_stream_peek(player->stream);
+    if (player->seq && player->seq_pos < player->seq->n_events)
+        return &player->seq->events[player->seq_pos];
+    return NULL;
+}
+static void next_event (MDV_Player* player) {
+    if (player->stream)
+        mdv_stream_next(player->stream);
+    else player->seq_pos += 1;
+}
+
+ // The first sample at or after an event time (see MDV_Sequence).  With
+ //  rates up to MDV_MAX_SAMPLE_RATE, this doesn't overflow.
+static uint64_t time_to_sample (MDV_Player* player, uint64_t time) {
+    const uint64_t second = 1000000ULL << 20;
+    return time / second * player->sample_rate
+         + (time % second * player->sample_rate + second - 1) / second;
+}
+
+ // The sample the next event is due at, or UINT64_MAX if there isn't one
+static uint64_t next_event_sample (MDV_Player* player) {
+    if (player->stream)
+        return mdv_stream_peek(player->stream)
+            ? time_to_sample(player, mdv_stream_time(player->stream)) : UINT64_MAX;
+    if (player->seq && player->seq_pos < player->seq->n_events)
+        return time_to_sample(player, player->seq->times[player->seq_pos]);
+    return UINT64_MAX;
+}
+
+ // Play all the events due by the current sample.  With skip_notes, only
+ //  channel state changes, which is what seeking needs.
+static void play_due_events (MDV_Player* player, int skip_notes) {
+    while (next_event_sample(player) <= player->sample) {
+         // Streams reuse the event's memory, so copy it first
+        MDV_Timed_Event te = *peek_event(player);
+        next_event(player);
+        if (!skip_notes || (te.event.type != MDV_NOTE_ON && te.event.type != MDV_NOTE_OFF)) {
+            mdv_play_event(player, &te.event);
+            if (COUNTERS) player->counters.events += 1;
+        }
+    }
+}
+
+int mdv_queue_event (MDV_Player* player, uint64_t sample, const MDV_Event* event) {
+    Event_Queue* q = player->queue;
+    uint32_t tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == MDV_EVENT_QUEUE_SIZE)
+        return 0;
+    Queued_Event* qe = &q->events[tail % MDV_EVENT_QUEUE_SIZE];
+    qe->sample = sample;
+    qe->event = *event;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+uint64_t mdv_get_clock (MDV_Player* player) {
+    return __atomic_load_n(&player->queue->clock, __ATOMIC_ACQUIRE);
+}
+
+ // The sample the next queued event is due at, or UINT64_MAX if there isn't
+ //  one
+static uint64_t next_queued_sample (MDV_Player* player) {
+    Event_Queue* q = player->queue;
+    if (!q || q->head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+        return UINT64_MAX;
+    return q->events[q->head % MDV_EVENT_QUEUE_SIZE].sample;
+}
+
+ // Play all the queued events due by the current sample
+static void play_queued_events (MDV_Player* player) {
+    Event_Queue* q = player->queue;
+    while (next_queued_sample(player) <= player->sample) {
+        MDV_Event ev = q->events[q->head % MDV_EVENT_QUEUE_SIZE].event;
+         // Hand the slot back before playing, so the producer can reuse it
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+        mdv_play_event(player, &ev);
+        if (COUNTERS) player->counters.events += 1;
+    }
 }
 
 int mdv_currently_playing (MDV_Player* player) {
-    return player->seq
-        && (player->seq_pos < player->seq->n_events
-         || player->n_active_voices > 0);
+    return (player->seq || player->stream)
+        && (peek_event(player) || player->n_active_voices > 0);
 }
 
 void mdv_set_patch (MDV_Player* player, uint8_t bank, uint8_t program, MDV_Patch* patch) {
     if (bank+1 > player->n_banks) {
         player->banks = realloc(player->banks, (bank+1) * sizeof(MDV_Patch**));
-        for (uint8_t i = player->n_banks; i < bank; i++)
+        for (uint8_t i = player->n_banks; i <= bank; i++)
             player->banks[i] = NULL;
         player->n_banks = bank + 1;
+    }
+    if (!player->banks[bank]) {
         player->banks[bank] = malloc(128 * sizeof(MDV_Patch*));
         for (uint8_t i = 0; i < 128; i++) {
             player->banks[bank][i] = NULL;
@@ -154,9 +510,11 @@ void mdv_set_patch (MDV_Player* player, uint8_t bank, uint8_t program, MDV_Patch
 void mdv_set_drum (MDV_Player* player, uint8_t bank, uint8_t program, MDV_Patch* patch) {
     if (bank+1 > player->n_drumsets) {
         player->drumsets = realloc(player->drumsets, (bank+1) * sizeof(MDV_Patch**));
-        for (uint8_t i = player->n_drumsets; i < bank; i++)
+        for (uint8_t i = player->n_drumsets; i <= bank; i++)
             player->drumsets[i] = NULL;
         player->n_drumsets = bank + 1;
+    }
+    if (!player->drumsets[bank]) {
         player->drumsets[bank] = malloc(128 * sizeof(MDV_Patch*));
         for (uint8_t i = 0; i < 128; i++) {
             player->drumsets[bank][i] = NULL;
@@ -172,20 +530,192 @@ void mdv_set_drum (MDV_Player* player, uint8_t bank, uint8_t program, MDV_Patch*
     player->drumsets[bank][program] = patch;
 }
 
+ // Never blocks.  If the patch is in the library but not loaded yet, this
+ //  returns NULL and sets *pending.
+static MDV_Patch* find_patch (MDV_Player* player, int drums, uint8_t bank, uint8_t program, int* pending) {
+    *pending = 0;
+    uint8_t n = drums ? player->n_drumsets : player->n_banks;
+    MDV_Patch*** table = drums ? player->drumsets : player->banks;
+    if (bank < n && table[bank] && table[bank][program])
+        return table[bank][program];
+    if (player->library)
+        return mdv_library_patch(player->library, drums, bank, program, pending);
+    return NULL;
+}
+
+void mdv_use_patch_library (MDV_Player* player, MDV_Patch_Library* lib) {
+    for (uint8_t i = 0; i < 16; i++) {
+        MDV_Event e = {MDV_CONTROLLER, i, MDV_ALL_SOUND_OFF, 0};
+        mdv_play_event(player, &e);
+    }
+    mdv_patch_library_ref(lib);
+    mdv_free_patch_library(player->library);
+    player->library = lib;
+     // Look up the current programs again in the new library
+    for (Channel* ch = player->channels; ch < player->channels + 16; ch++) {
+        if (ch->program != 255) {
+            int pending;
+            ch->patch = find_patch(player, 0, ch->program_bank, ch->program, &pending);
+            ch->patch_pending = pending;
+        }
+    }
+}
+
+static void link_note (MDV_Player* player, Voice* v) {
+     // Notes that patches moved out of range can't be turned off anyway
+    v->in_notes = v->note < 128;
+    if (!v->in_notes) return;
+    uint8_t* head = &player->notes[v->channel][v->note];
+    v->note_prev = 255;
+    v->note_next = *head;
+    if (*head != 255)
+        player->voices[*head].note_prev = v - player->voices;
+    *head = v - player->voices;
+}
+
+static void unlink_note (MDV_Player* player, Voice* v) {
+    if (!v->in_notes) return;
+    v->in_notes = 0;
+    if (v->note_prev != 255)
+        player->voices[v->note_prev].note_next = v->note_next;
+    else player->notes[v->channel][v->note] = v->note_next;
+    if (v->note_next != 255)
+        player->voices[v->note_next].note_prev = v->note_prev;
+}
+
+ // Whether a is a better voice to steal than b: released voices first, then
+ //  the quietest, then the oldest.
+static int steal_before (MDV_Player* player, Voice* a, Voice* b) {
+    int released_a = a->envelope_phase >= 3;
+    int released_b = b->envelope_phase >= 3;
+    if (released_a != released_b)
+        return released_a;
+     // Don't steal notes before they've been heard
+    if (a->fresh != b->fresh)
+        return b->fresh;
+    float volume_a = player->mix[a - player->voices].volume;
+    float volume_b = player->mix[b - player->voices].volume;
+    if (volume_a != volume_b)
+        return volume_a < volume_b;
+    return (int32_t)(a->serial - b->serial) < 0;
+}
+
+ // The best voice to steal for a new note on this channel, or NULL if
+ //  there's nothing we're allowed to steal.
+static Voice* pick_victim (MDV_Player* player, uint8_t channel) {
+    int own_only = player->channels[channel].n_live_voices >= player->channel_polyphony[channel];
+    uint8_t allowed [16];
+    for (uint8_t c = 0; c < 16; c++) {
+        allowed[c] = own_only ? c == channel
+                   : c == channel || player->channels[c].n_live_voices > player->channel_reserve[c];
+    }
+    Voice* best = NULL;
+    for (uint8_t j = 0; j < player->n_active_voices; j++) {
+        Voice* v = &player->voices[player->active[j]];
+        if (allowed[v->channel] && !v->fade && (!best || steal_before(player, v, best)))
+            best = v;
+    }
+    return best;
+}
+
+static void fade_voice (MDV_Player* player, Voice* v) {
+    unlink_note(player, v);
+    v->fade = STEAL_FADE;
+    player->channels[v->channel].n_live_voices -= 1;
+    player->n_live_voices -= 1;
+}
+
+ // Take voices out of the active list, keeping the rest in order.  alive is
+ //  indexed by voice, and the ones it has 0 for are deleted.
+static void delete_voices (MDV_Player* player, uint8_t* alive) {
+    uint8_t n_inactive = 255 - player->n_active_voices;
+    uint8_t n = 0;
+    for (uint8_t j = 0; j < player->n_active_voices; j++) {
+        uint8_t i = player->active[j];
+        if (alive[i]) {
+            player->active[n++] = i;
+            continue;
+        }
+        Voice* v = &player->voices[i];
+        unlink_note(player, v);
+        if (!v->fade) {
+            player->channels[v->channel].n_live_voices -= 1;
+            player->n_live_voices -= 1;
+        }
+        player->inactive[n_inactive++] = i;
+    }
+    player->n_active_voices = n;
+}
+
+ // Cut off whichever fading voice is closest to done.  Only for when every
+ //  voice is in use, so there has to be one.
+static void cut_faded_voice (MDV_Player* player) {
+    uint8_t best = 255;
+    uint8_t alive [255];
+    for (uint8_t j = 0; j < player->n_active_voices; j++) {
+        uint8_t i = player->active[j];
+        alive[i] = 1;
+        if (player->voices[i].fade && (best == 255 || player->voices[i].fade < player->voices[best].fade))
+            best = i;
+    }
+    alive[best] = 0;
+    delete_voices(player, alive);
+}
+
+static void delete_channel_voices (MDV_Player* player, uint8_t channel) {
+    uint8_t alive [255];
+    for (uint8_t j = 0; j < player->n_active_voices; j++) {
+        uint8_t i = player->active[j];
+        alive[i] = player->voices[i].channel != channel;
+    }
+    delete_voices(player, alive);
+}
+
+ // Pan is applied per voice, so keep it up to date.
+static void update_pan (MDV_Player* player, uint8_t channel) {
+    Channel* ch = &player->channels[channel];
+    for (uint8_t j = 0; j < player->n_active_voices; j++) {
+        uint8_t i = player->active[j];
+        if (player->voices[i].channel == channel) {
+            player->mix[i].pan_l = 64 + ch->pan;
+            player->mix[i].pan_r = 64 - ch->pan;
+        }
+    }
+}
+
+ // Work out a sample's increments for the player's rate.  These are
+ //  TiMidity's formulas, and the 38s are an arbitrary scaling factor copied
+ //  from it.  Increasing them makes tremolo and vibrato go slower.
+static void bind_sample (MDV_Player* player, Voice* v, MDV_Sample* s) {
+    uint32_t rate = player->sample_rate;
+    v->root_inc = s->sample_rate * 0x100000000LL / rate;
+    for (int j = 0; j < 6; j++) {
+        v->envelope_rates[j] = (s->envelope_rates[j] * 44100 / rate) << 9;
+    }
+    v->tremolo_sweep_inc = !s->tremolo_sweep ? 0 :
+        (38 * 0x1000000) / (rate * s->tremolo_sweep);
+    v->tremolo_phase_inc = (s->tremolo_rate * 0x1000000U) / (38 * rate);
+    v->vibrato_sweep_inc = !s->vibrato_sweep ? 0 :
+        (38 * 0x1000000) / (rate * s->vibrato_sweep);
+    v->vibrato_phase_inc = (s->vibrato_rate * 0x1000000U) / (38 * rate);
+}
+
 void mdv_play_event (MDV_Player* player, MDV_Event* event) {
     if (event->channel > 16) return;
     Channel* ch = &player->channels[event->channel];
     switch (event->type) {
         case MDV_NOTE_OFF: {
             do_note_off:
-            if (!ch->is_drums) {
-                for (uint8_t i = ch->voices; i != 255; i = player->voices[i].next) {
+            if (!ch->is_drums && event->param1 < 128) {
+                 // Release the newest voice on this note that isn't released
+                uint8_t i = player->notes[event->channel][event->param1];
+                while (i != 255) {
                     Voice* v = &player->voices[i];
-                    if (v->note == event->param1) {
-                        if (v->envelope_phase < 3) {
-                            v->envelope_phase = 3;
-                            break;
-                        }
+                    i = v->note_next;
+                    unlink_note(player, v);
+                    if (v->envelope_phase < 3) {
+                        v->envelope_phase = 3;
+                        break;
                     }
                 }
             }
@@ -194,51 +724,76 @@ void mdv_play_event (MDV_Player* player, MDV_Event* event) {
         case MDV_NOTE_ON: {
             if (event->param2 == 0)
                 goto do_note_off;
-            if (player->inactive != 255) {
-                player->n_active_voices += 1;
-                Voice* v = &player->voices[player->inactive];
-                player->inactive = v->next;
-                v->next = ch->voices;
-                ch->voices = v - player->voices;
-                v->note = event->param1;
-                v->velocity = event->param2;
-                v->backwards = 0;
-                v->control_timer = 1;
-                v->sample_pos = 0;
-                v->envelope_phase = 0;
-                v->envelope_value = 0;
-                v->tremolo_sweep = 0;
-                v->tremolo_phase = 0;
-                v->vibrato_sweep = 0;
-                v->vibrato_phase = 0;
-                 // Decide which patch sample we're using
-                MDV_Patch* patch = ch->is_drums
-                    ? ch->bank < player->n_drumsets ? player->drumsets[ch->bank][v->note] : NULL
-                    : ch->patch;
-                if (patch) {
-                    v->patch_volume = patch->volume;
-                    v->do_envelope = !ch->is_drums || patch->keep_envelope;
-                    v->do_loop = !ch->is_drums || patch->keep_loop;
-                    uint32_t freq = get_freq(v->note * 0x10000);
-                    v->sample = &patch->samples[0];
-                    for (uint8_t i = 0; i < patch->n_samples; i++) {
-                        if (patch->samples[i].high_freq > freq) {
-                            v->sample = &patch->samples[i];
-                            break;
-                        }
-                    }
-                    if (patch->note >= 0)
-                        v->note = patch->note;
-                    else if (v->sample->scale_factor != 1024) {
-                         // TODO: I guess this means that v->note needs to be 16-bit.
-                        v->note += (v->note - v->sample->scale_note)
-                                 * (v->sample->scale_factor - 1024) / 1024;
-                    }
+             // If the patch is still loading, drop the note instead of
+             //  waiting for it.
+            int pending;
+            MDV_Patch* patch;
+            if (ch->is_drums) {
+                patch = find_patch(player, 1, ch->bank, event->param1, &pending);
+            }
+            else if (ch->patch_pending) {
+                patch = ch->patch = find_patch(player, 0, ch->program_bank, ch->program, &pending);
+                ch->patch_pending = pending;
+            }
+            else {
+                patch = ch->patch;
+                pending = 0;
+            }
+            if (pending) break;
+             // Steal a voice if we're at either limit, and drop the note if
+             //  there's nothing to steal
+            if (ch->n_live_voices >= player->channel_polyphony[event->channel]
+             || player->n_live_voices >= player->polyphony) {
+                Voice* victim = pick_victim(player, event->channel);
+                if (!victim) {
+                    if (COUNTERS) player->counters.dropped_notes += 1;
+                    break;
                 }
-                else {
-                    v->sample = NULL;
+                fade_voice(player, victim);
+            }
+            if (player->n_active_voices == 255)
+                cut_faded_voice(player);
+            uint8_t vi = player->inactive[254 - player->n_active_voices];
+            player->active[player->n_active_voices++] = vi;
+            player->n_live_voices += 1;
+            ch->n_live_voices += 1;
+            Voice* v = &player->voices[vi];
+            Voice_Mix* m = &player->mix[vi];
+            v->channel = event->channel;
+            v->note = event->param1;
+            v->velocity = event->param2;
+            v->fade = 0;
+            v->fresh = 1;
+            v->serial = player->voice_serial++;
+            m->pan_l = 64 + ch->pan;
+            m->pan_r = 64 - ch->pan;
+            m->sample_pos = 0;
+            v->envelope_phase = 0;
+            v->envelope_value = 0;
+            v->tremolo_sweep = 0;
+            v->tremolo_phase = 0;
+            v->vibrato_sweep = 0;
+            v->vibrato_phase = 0;
+             // Decide which patch sample we're using
+            if (patch) {
+                v->patch_volume = patch->volume;
+                v->do_envelope = !ch->is_drums || patch->keep_envelope;
+                m->sample = &patch->samples[patch->note_samples[v->note]];
+                bind_sample(player, v, m->sample);
+                m->mode = ch->is_drums && !patch->keep_loop ? MODE_ONE_SHOT : MODE_LOOP;
+                if (patch->note >= 0)
+                    v->note = patch->note;
+                else if (m->sample->scale_factor != 1024) {
+                     // TODO: I guess this means that v->note needs to be 16-bit.
+                    v->note += (v->note - m->sample->scale_note)
+                             * (m->sample->scale_factor - 1024) / 1024;
                 }
             }
+            else {
+                m->sample = NULL;
+                m->mode = ch->is_drums ? MODE_SILENT : MODE_SQUARE;
+            }
+            link_note(player, v);
             break;
         }
         case MDV_CONTROLLER: {
@@ -266,6 +821,13 @@ void mdv_play_event (MDV_Player* player, MDV_Event* event) {
                     break;
                 case MDV_PAN:
                     ch->pan = event->param2 - 64;
+                    update_pan(player, event->channel);
+                    break;
+                case MDV_REVERB:
+                    ch->reverb = event->param2;
+                    break;
+                case MDV_CHORUS:
+                    ch->chorus = event->param2;
                     break;
                 case MDV_RPN_LSB:
                     ch->rpn = (ch->rpn & 0x3f80) | (event->param2 & 0x7f);
@@ -274,9 +836,7 @@ void mdv_play_event (MDV_Player* player, MDV_Event* event) {
                     ch->rpn = (ch->rpn & 0x007f) | ((event->param2 << 7) & 0x3f80);
                     break;
                 case MDV_ALL_SOUND_OFF:
-                    for (uint8_t i = ch->voices; i != 255; i = player->voices[i].next)
-                        player->n_active_voices -= 1;
-                    ch->voices = 255;
+                    delete_channel_voices(player, event->channel);
                     break;
                 case MDV_ALL_CONTROLLERS_OFF:
                     ch->rpn = 0x3fff;
@@ -286,11 +846,15 @@ void mdv_play_event (MDV_Player* player, MDV_Event* event) {
                     ch->expression = 127;
                     ch->pan = 0;
                     ch->bank = 0;
+                    update_pan(player, event->channel);
                     break;
                 case MDV_ALL_NOTES_OFF:
-                    for (uint8_t i = ch->voices; i != 255; i = player->voices[i].next) {
-                        if (player->voices[i].envelope_phase < 3)
-                            player->voices[i].envelope_phase = 3;
+                    for (uint8_t j = 0; j < player->n_active_voices; j++) {
+                        Voice* v = &player->voices[player->active[j]];
+                        if (v->channel != event->channel) continue;
+                        unlink_note(player, v);
+                        if (v->envelope_phase < 3)
+                            v->envelope_phase = 3;
                     }
                     break;
                 default:
@@ -299,9 +863,11 @@ void mdv_play_event (MDV_Player* player, MDV_Event* event) {
             break;
         }
         case MDV_PROGRAM_CHANGE: {
-            ch->patch = ch->bank < player->n_banks
-                ? player->banks[ch->bank][event->param1]
-                : NULL;
+            int pending;
+            ch->program = event->param1;
+            ch->program_bank = ch->bank;
+            ch->patch = find_patch(player, 0, ch->bank, event->param1, &pending);
+            ch->patch_pending = pending;
             break;
         }
         case MDV_PITCH_BEND: {
@@ -318,15 +884,21 @@ void mdv_play_event (MDV_Player* player, MDV_Event* event) {
                         ch->volume = 127;
                         ch->expression = 127;
                         ch->pan = 0;
-                        ch->voices = 255;
                         ch->is_drums = 0;
+                        ch->bank = 0;
                         ch->patch = NULL;
+                        ch->program = 255;
+                        ch->patch_pending = 0;
+                        ch->n_live_voices = 0;
+                        ch->reverb = 0;
+                        ch->chorus = 0;
                     }
                     player->channels[9].is_drums = 1;
-                    player->inactive = 0;
+                    memset(player->notes, 255, sizeof(player->notes));
                     player->n_active_voices = 0;
+                    player->n_live_voices = 0;
                     for (uint32_t i = 0; i < 255; i++) {
-                        player->voices[i].next = i + 1;
+                        player->inactive[i] = 254 - i;
                     }
                     break;
                 }
@@ -334,11 +906,8 @@ void mdv_play_event (MDV_Player* player, MDV_Event* event) {
             }
             break;
         }
-        case MDV_SET_TEMPO: {
-            uint32_t ms_per_beat = event->channel << 16 | event->param1 << 8 | event->param2;
-            player->tick_length = (uint64_t)MDV_SAMPLE_RATE * ms_per_beat / 1000000 / player->seq->tpb;
-            break;
-        }
+        case MDV_SET_TEMPO:
+             // Already applied to the event times
         default:
             break;
     }
@@ -350,228 +919,770 @@ typedef struct Samp {
 } Samp;
 
 void mdv_fast_forward_to_note (MDV_Player* player) {
-    MDV_Sequence* seq = player->seq;
-    if (!seq) return;
-    while (player->seq_pos < seq->n_events
-        && seq->events[player->seq_pos].event.type != MDV_NOTE_ON
-    ) {
-        mdv_play_event(player, &seq->events[player->seq_pos].event);
-        player->seq_pos += 1;
+    const MDV_Timed_Event* te;
+    while ((te = peek_event(player)) && te->event.type != MDV_NOTE_ON) {
+        MDV_Event ev = te->event;
+        next_event(player);
+        mdv_play_event(player, &ev);
     }
-    player->samples_to_tick = 0;
-    player->ticks_to_event = 0;
+    if (te)
+        player->sample = next_event_sample(player);
 }
 
-#define MAX_CHUNK_LENGTH 512
+ // Restore a checkpoint, with all voices cut off
+static void restore_checkpoint (MDV_Player* player, Checkpoint* cp) {
+    for (uint8_t i = 0; i < 16; i++) {
+        MDV_Event e = {MDV_CONTROLLER, i, MDV_ALL_SOUND_OFF, 0};
+        mdv_play_event(player, &e);
+    }
+    if (player->effects)
+        effects_clear(player->effects);
+    player->seq_pos = cp->seq_pos;
+    player->sample = cp->sample;
+    memcpy(player->channels, cp->channels, sizeof(cp->channels));
+    for (Channel* ch = player->channels; ch < player->channels + 16; ch++) {
+        ch->n_live_voices = 0;
+        if (ch->program != 255) {
+            int pending;
+            ch->patch = find_patch(player, 0, ch->program_bank, ch->program, &pending);
+            ch->patch_pending = pending;
+        }
+    }
+}
 
-void mdv_get_audio (MDV_Player* player, uint8_t* buf_, int len) {
-    int16_t(* buf )[2] = (int16_t(*)[2])buf_;
-    len /= 4;  // Assuming always a whole number of samples
-    if (!mdv_currently_playing(player)) {
-        for (int i = 0; i < len; i++) {
-            buf[i][0] = 0;
-            buf[i][1] = 0;
+static void save_checkpoint (MDV_Player* player, Checkpoint* cp) {
+    cp->sample = player->sample;
+    cp->seq_pos = player->seq_pos;
+    memcpy(cp->channels, player->channels, sizeof(cp->channels));
+}
+
+ // Play events without audio up to target, leaving the player just as
+ //  get_audio would.  If index is set, save checkpoints along the way.
+static void run_timeline (MDV_Player* player, uint64_t target, int index) {
+    uint32_t max_checkpoints = 0;
+    uint64_t due;
+    while ((due = next_event_sample(player)) < target) {
+        player->sample = due;
+        uint64_t last = player->n_checkpoints
+            ? player->checkpoints[player->n_checkpoints - 1].sample : 0;
+        if (index && due - last >= CHECKPOINT_INTERVAL * player->sample_rate) {
+            if (player->n_checkpoints >= max_checkpoints) {
+                max_checkpoints = max_checkpoints ? max_checkpoints * 2 : 64;
+                player->checkpoints = realloc(player->checkpoints, max_checkpoints * sizeof(Checkpoint));
+            }
+            save_checkpoint(player, &player->checkpoints[player->n_checkpoints++]);
         }
+        play_due_events(player, 1);
+    }
+    player->sample = target;
+}
+
+void mdv_seek (MDV_Player* player, uint64_t sample) {
+    if (player->stream) {
+         // No index for streams, so go all the way back
+        mdv_rewind_stream(player->stream);
+        restore_checkpoint(player, &player->start);
+        run_timeline(player, sample, 0);
         return;
     }
-    int buf_pos = 0;
-    while (buf_pos < len) {
-     // Advance event timeline.
-        if (!player->samples_to_tick) {
-            MDV_Sequence* seq = player->seq;
-            while (player->seq_pos < seq->n_events && !player->ticks_to_event) {
-                MDV_Timed_Event* te = &seq->events[player->seq_pos];
-                mdv_play_event(player, &te->event);
-                player->seq_pos += 1;
-                if (player->seq_pos < seq->n_events) {
-                    player->ticks_to_event = seq->events[player->seq_pos].time - te->time;
+    if (!player->seq) return;
+    if (!player->checkpoints) {
+        restore_checkpoint(player, &player->start);
+        run_timeline(player, UINT64_MAX, 1);
+    }
+     // Latest checkpoint at or before the target
+    uint32_t lo = 0;
+    uint32_t hi = player->n_checkpoints;
+    while (hi - lo > 1) {
+        uint32_t mid = (lo + hi) / 2;
+        if (player->checkpoints[mid].sample <= sample) lo = mid;
+        else hi = mid;
+    }
+    Checkpoint* cp = player->n_checkpoints && player->checkpoints[0].sample <= sample
+        ? &player->checkpoints[lo] : &player->start;
+    restore_checkpoint(player, cp);
+    run_timeline(player, sample, 0);
+}
+
+ // inc * freq / root.  Low output rates with high notes can take this past
+ //  64 bits, so go to 128 for those.
+static int64_t scale_inc (int64_t inc, uint32_t freq, uint32_t root) {
+    uint64_t product;
+    if (!__builtin_mul_overflow((uint64_t)inc, freq, &product))
+        return product / root;
+    return (unsigned __int128)(uint64_t)inc * freq / root;
+}
+
+ // Update a voice's envelope, LFOs and pitch for the next control block, and
+ //  ramp its volume and increment toward the results.  A fresh voice starts
+ //  at them instead.  Returns 0 if the voice has ended.  This only touches
+ //  the voice itself, so different voices can be updated on different
+ //  threads.
+static int control_voice (MDV_Player* player, uint8_t vi) {
+    Voice* v = &player->voices[vi];
+    Voice_Mix* m = &player->mix[vi];
+    Channel* ch = &player->channels[v->channel];
+    int fresh = v->fresh;
+    v->fresh = 0;
+    if (m->mode == MODE_SILENT) {
+        return 1;
+    }
+    else if (m->mode == MODE_SQUARE) {
+        uint32_t freq = get_freq(v->note << 8);
+        m->sample_inc = 0x100000000LL * freq / 1000 / player->sample_rate;
+        m->volume = v->velocity * ch->volume * ch->expression / (32*127);
+        return v->envelope_phase < 3 && !v->fade;
+    }
+     // Do envelopes  TODO: fade to 0 at end  TODO2: what did I mean when I wrote that
+    if (v->do_envelope) {
+        uint32_t rate = v->envelope_rates[v->envelope_phase] * CONTROL_UPDATE_INTERVAL;
+        uint32_t target = m->sample->envelope_offsets[v->envelope_phase];
+        if (target > v->envelope_value) {  // Get louder
+            if (v->envelope_value + rate < target) {
+                v->envelope_value += rate;
+            }
+            else if (v->envelope_phase == 5) {
+                return 0;
+            }
+            else {
+                v->envelope_value = target;
+                if (v->envelope_phase != 2 || !m->sample->sustain) {
+                    v->envelope_phase += 1;
+                }
+            }
+        }
+        else {  // Get quieter
+            if (target + rate < v->envelope_value) {
+                v->envelope_value -= rate;
+            }
+            else if (v->envelope_phase == 5 || target == 0) {
+                return 0;
+            }
+            else {
+                v->envelope_value = target;
+                if (v->envelope_phase != 2 || !m->sample->sustain) {
+                    v->envelope_phase += 1;
                 }
             }
-            if (player->ticks_to_event)
-                player->ticks_to_event -= 1;
-            player->samples_to_tick = player->tick_length;
         }
-        int chunk_length = player->samples_to_tick < len - buf_pos
-                         ? player->samples_to_tick : len - buf_pos;
+    }
+    else { v->envelope_value = 0x3ff00000; }
+     // Tremolo
+    v->tremolo_sweep += v->tremolo_sweep_inc * CONTROL_UPDATE_INTERVAL;
+    if (v->tremolo_sweep > 0x1000000)
+        v->tremolo_sweep = 0x1000000;
+    v->tremolo_phase += v->tremolo_phase_inc * CONTROL_UPDATE_INTERVAL;
+    if (v->tremolo_phase >= 0x1000000)
+        v->tremolo_phase -= 0x1000000;
+    uint32_t tremolo = m->sample->tremolo_depth
+                     * v->tremolo_sweep / (0x1000000 / 0x80)
+                     * sines[v->tremolo_phase / (0x1000000 / SINES_SIZE)] / 0x8000;
+     // Volume calculation.
+    if (v->envelope_phase < 3) {
+        v->channel_volume = (uint32_t)vols[ch->volume]
+                          * vols[ch->expression] / 0x10000;
+    }
+    uint32_t volume = (uint32_t)v->patch_volume * 0x100
+                    * v->channel_volume / 0x10000
+                    * vols[v->velocity] / 0x10000
+                    * envs[v->envelope_value / 0x100000] / 0x10000
+                    * (0x10000 + tremolo) / 0x10000;
+    if (v->fade) {
+         // Reaches 0 one block before the voice ends
+        if (v->fade == 1) return 0;
+        v->fade -= 1;
+        volume = (uint64_t)volume * (v->fade - 1) / (STEAL_FADE - 1);
+    }
+     // Vibrato
+    v->vibrato_sweep += v->vibrato_sweep_inc * CONTROL_UPDATE_INTERVAL;
+    if (v->vibrato_sweep > 0x1000000)
+        v->vibrato_sweep = 0x1000000;
+    v->vibrato_phase += v->vibrato_phase_inc * CONTROL_UPDATE_INTERVAL;
+    if (v->vibrato_phase >= 0x1000000)
+        v->vibrato_phase -= 0x1000000;
+    uint32_t vibrato = m->sample->vibrato_depth
+                     * v->vibrato_sweep / (0x1000000 / 0x80)
+                     * sines[v->vibrato_phase / (0x1000000 / SINES_SIZE)] / 0x8000;
+     // Notes are on a logarithmic scale, so we add instead of multiplying
+    uint32_t note = (int64_t)v->note * 0x10000
+                  + (int64_t)ch->pitch_bend * ch->pitch_bend_sensitivity / 0x2000
+                  + vibrato * 4;  // Range over a whole step
+    int64_t inc = scale_inc(v->root_inc, get_freq(note), m->sample->root_freq);
+    float gain = volume * (1.0f / 0x10000);
+    if (fresh) {
+        m->volume = gain;
+        m->volume_step = 0;
+        m->sample_inc = inc;
+        m->inc_step = 0;
+    }
+    else {
+        m->volume_step = (gain - m->volume) * (1.0f / CONTROL_UPDATE_INTERVAL);
+        m->inc_step = (inc - m->sample_inc) / CONTROL_UPDATE_INTERVAL;
+    }
+    return 1;
+}
+
+ // Mix a sampled voice for n_samples.  This is only called with a constant
+ //  mode, so each mode gets its own copy with the mode checks folded away.
+ //  Between loop boundaries, runs go straight to the mix kernel.  Returns 0
+ //  if the voice has ended.
+static inline int mix_sampled (
+    MDV_Player* player, Voice_Mix* m, int32_t(* out )[2], int n_samples, int mode
+) {
+    MDV_Sample* s = m->sample;
+    int i = 0;
+    while (i < n_samples) {
+         // Stop at the loop boundary.  The increment is largest at one end
+         //  of the run, so use that to be safe.
+        int n = n_samples - i;
+        int64_t inc_max = m->inc_step > 0 ? m->sample_inc + n * m->inc_step : m->sample_inc;
+        if (m->sample_pos + n * inc_max >= s->loop_end) {
+            int64_t to_boundary = m->sample_pos >= s->loop_end ? 1
+                : (s->loop_end - m->sample_pos + inc_max - 1) / inc_max;
+            if (to_boundary < n)
+                n = to_boundary;
+        }
+        if (out) player->mix_run(
+            s->data, m->sample_pos, m->sample_inc, m->inc_step, n,
+            m->volume, m->volume_step, m->pan_l, m->pan_r,
+            out + i
+        );
+        m->sample_pos += n * m->sample_inc + m->inc_step * ((int64_t)n * (n - 1) / 2);
+        m->sample_inc += n * m->inc_step;
+        m->volume += m->volume_step * n;
+        i += n;
+         // TODO: go all the way to sample end if no loop
+        if (m->sample_pos >= s->loop_end) {
+            if (mode == MODE_ONE_SHOT) return 0;
+            m->sample_pos -= s->loop_end - s->loop_start;
+        }
+    }
+    return 1;
+}
+
+static int mix_one_shot (MDV_Player* player, Voice_Mix* m, int32_t(* out )[2], int n) {
+    return mix_sampled(player, m, out, n, MODE_ONE_SHOT);
+}
+static int mix_loop (MDV_Player* player, Voice_Mix* m, int32_t(* out )[2], int n) {
+    return mix_sampled(player, m, out, n, MODE_LOOP);
+}
+
+ // The square wave's increment and amplitude are set by control_voice.
+static void mix_square (Voice_Mix* m, int32_t(* out )[2], int n_samples) {
+    uint32_t pos = m->sample_pos;
+    uint32_t inc = m->sample_inc;
+    if (out) {
+        int32_t val = m->volume;
+        for (int i = 0; i < n_samples; i++) {
+            int32_t v = pos < 0x80000000 ? -val : val;
+            out[i][0] += v;
+            out[i][1] += v;
+            pos += inc;
+        }
+    }
+    else pos += (uint32_t)n_samples * inc;
+    m->sample_pos = pos;
+}
+
+ // Mix one voice into out for n_samples, which mustn't cross into another
+ //  control block.  Returns 0 if the voice has ended.  If out is NULL, the
+ //  voice advances exactly as if it were mixed.
+static int mix_voice (MDV_Player* player, uint8_t vi, int32_t(* out )[2], int n_samples) {
+    Voice_Mix* m = &player->mix[vi];
+    switch (m->mode) {
+        case MODE_SQUARE: mix_square(m, out, n_samples); return 1;
+        case MODE_ONE_SHOT: return mix_one_shot(player, m, out, n_samples);
+        case MODE_LOOP: return mix_loop(player, m, out, n_samples);
+        default: return 1;
+    }
+}
+
+ // Render a range of the active list into the chunk's buses, which start at
+ //  sample start, and set alive for each of those voices.  If buses is NULL,
+ //  voices advance without mixing.  Each control block goes in two passes:
+ //  control updates for all the voices, and then mixing.  Adds how many
+ //  control updates there were to control_updates, which other threads may
+ //  be adding to too, and if control_ns isn't NULL, an estimate of the time
+ //  they took.
+static void render_voices (
+    MDV_Player* player, int begin, int end, uint64_t start,
+    int32_t(** buses )[2], int chunk_length, uint8_t* alive,
+    uint64_t* control_updates, uint64_t* control_ns
+) {
+    uint64_t updates = 0;
+    for (int j = begin; j < end; j++)
+        alive[player->active[j]] = 1;
+    int pos = 0;
+    while (pos < chunk_length) {
+        int offset = (start + pos) % CONTROL_UPDATE_INTERVAL;
+        int n = CONTROL_UPDATE_INTERVAL - offset;
+        if (n > chunk_length - pos)
+            n = chunk_length - pos;
+        int timed = COUNTERS && control_ns
+            && (start + pos) / CONTROL_UPDATE_INTERVAL % CONTROL_TIMING_SAMPLE == 0;
+        uint64_t control_start = timed ? counter_clock() : 0;
+        for (int j = begin; j < end; j++) {
+            uint8_t i = player->active[j];
+            if (alive[i] && (offset == 0 || player->voices[i].fresh)) {
+                alive[i] = control_voice(player, i);
+                updates += 1;
+            }
+        }
+        if (timed)
+            *control_ns += (counter_clock() - control_start) * CONTROL_TIMING_SAMPLE;
+        for (int j = begin; j < end; j++) {
+            uint8_t i = player->active[j];
+            if (alive[i]) {
+                int32_t(* out )[2] = buses
+                    ? buses[player->channel_bus[player->voices[i].channel]] + pos : NULL;
+                alive[i] = mix_voice(player, i, out, n);
+            }
+        }
+        pos += n;
+    }
+    if (COUNTERS)
+        __atomic_fetch_add(control_updates, updates, __ATOMIC_RELAXED);
+}
+
+typedef struct Mix_Job {
+    MDV_Player* player;
+    uint64_t start;
+    int chunk_length;
+    int n_buses;
+    int32_t(** buses )[2];
+    uint8_t alive [255];
+    uint64_t control_updates;
+    uint64_t control_ns;  // Only timed on worker 0
+} Mix_Job;
+
+ // Each thread's own set of buses
+static int32_t(* partial_bus (MDV_Player* player, int worker, int bus) )[2] {
+    return player->partial_chunks[(worker - 1) * MAX_BUSES + bus];
+}
+
+ // Each thread takes a contiguous range of the active list.  Thread 0 mixes
+ //  straight into the chunk and the others into their own partial buses,
+ //  which get summed afterwards.  Since that's all integer addition, the
+ //  result doesn't depend on how the voices were split.
+static void mix_job (void* job_, int worker) {
+    Mix_Job* job = (Mix_Job*)job_;
+    MDV_Player* player = job->player;
+    int32_t(** buses )[2] = job->buses;
+    int32_t(* partial [MAX_BUSES])[2];
+    if (worker) {
+        for (int b = 0; b < job->n_buses; b++) {
+            partial[b] = partial_bus(player, worker, b);
+            memset(partial[b], 0, job->chunk_length * sizeof(*partial[b]));
+        }
+        buses = partial;
+    }
+    int n_threads = player->pool->n_threads;
+    int n_voices = player->n_active_voices;
+    render_voices(player,
+        n_voices * worker / n_threads, n_voices * (worker + 1) / n_threads,
+        job->start, buses, job->chunk_length, job->alive,
+        &job->control_updates, worker ? NULL : &job->control_ns
+    );
+}
+
+static int16_t clip (int32_t v) {
+    return v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+}
+
+ // Don't bother waking up threads for less than this many voice-samples.
+#define MIN_THREADED_MIX 4096
+
+typedef struct Audio_Out {
+    int16_t(* master )[2];
+    int16_t(** stems )[2];
+    int n_stems;
+     // Offline rendering does the effects afterwards, in order, so instead of
+     //  master it takes the mix before them and what was sent to them.
+    int32_t(* dry )[2];
+    float* sends [2];
+} Audio_Out;
+
+ // Does the work of mdv_get_audio and mdv_get_stem_audio, with len in
+ //  frames.  If out is NULL, the player advances exactly as if it were
+ //  rendering, but nothing is mixed.  Returns how many frames were rendered
+ //  before playback finished (len if it didn't finish).
+static int get_audio (MDV_Player* player, const Audio_Out* out, int len) {
+    int n_stems = out ? out->n_stems : 0;
+    if (n_stems > MDV_MAX_STEMS)
+        n_stems = MDV_MAX_STEMS;
+     // Live input keeps the player going without a sequence
+    if (!mdv_currently_playing(player) && !player->n_active_voices
+        && next_queued_sample(player) == UINT64_MAX
+    ) {
+         // Time still passes, so events can be queued against the clock
+        player->sample += len;
+        if (player->queue)
+            __atomic_store_n(&player->queue->clock, player->sample, __ATOMIC_RELEASE);
+        if (!out) return 0;
+        if (out->master) memset(out->master, 0, len * sizeof(*out->master));
+        for (int s = 0; s < n_stems; s++)
+            if (out->stems[s]) memset(out->stems[s], 0, len * sizeof(*out->stems[s]));
+        if (out->dry) memset(out->dry, 0, len * sizeof(*out->dry));
+        for (int e = 0; e < 2; e++)
+            if (out->sends[e]) memset(out->sends[e], 0, len * sizeof(float));
+        return 0;
+    }
+     // Each stem being rendered gets a bus, and voices of the other channels
+     //  go on bus 0.  Buses are summed for the master output.
+    int n_stem_buses = 1;
+    uint8_t stem_bus [MDV_MAX_STEMS] = {0};
+    int16_t(* bus_out [MDV_MAX_STEMS + 1])[2];
+    for (int s = 0; s < n_stems; s++) {
+        if (out->stems[s]) {
+            bus_out[n_stem_buses] = out->stems[s];
+            stem_bus[s] = n_stem_buses++;
+        }
+    }
+    int mixing = out && (out->master || out->dry || n_stem_buses > 1);
+    int sending = mixing && (out->dry ? out->sends[0] != NULL : player->effects != NULL);
+    float sends [2][MAX_CHUNK_LENGTH] __attribute__((aligned(64)));
+    int played = len;
+    int buf_pos = 0;
+    while (buf_pos < len) {
+        uint64_t events_start = counter_clock();
+         // Advance event timeline, and mix up to the next event.
+        play_due_events(player, 0);
+        play_queued_events(player);
+        uint64_t next = next_event_sample(player);
+        uint64_t queued = next_queued_sample(player);
+        uint64_t until_event = (queued < next ? queued : next) - player->sample;
+        int chunk_length = until_event < (uint64_t)(len - buf_pos)
+                         ? (int)until_event : len - buf_pos;
         if (chunk_length > MAX_CHUNK_LENGTH)
             chunk_length = MAX_CHUNK_LENGTH;
-        player->samples_to_tick -= chunk_length;
+         // Channels with effect sends get their own bus for this chunk, so
+         //  their sends can be taken from it.  Then it's added to their stem.
+        int n_buses = n_stem_buses;
+        uint8_t send_channels [16];
+        int n_send_channels = 0;
+        for (uint8_t c = 0; c < 16; c++) {
+            Channel* ch = &player->channels[c];
+            if (sending && (ch->reverb || ch->chorus)) {
+                send_channels[n_send_channels++] = c;
+                player->channel_bus[c] = n_buses++;
+            }
+            else player->channel_bus[c] = stem_bus[player->channel_stem[c]];
+        }
 
+        uint64_t mix_start = counter_clock();
+        uint8_t n_active_voices = player->n_active_voices;
          // Mix voices a whole chunk at a time.  This is better for the CPU cache.
-        int32_t chunk [chunk_length][2];
-        for (int i = 0; i < chunk_length; i++) {
-            chunk[i][0] = 0;
-            chunk[i][1] = 0;
-        }
-        for (Channel* ch = player->channels+0; ch < player->channels+16; ch++) {
-             // A bunch of pointer shuffling for the linked list
-            uint8_t* next_ip;
-            for (uint8_t* ip = &ch->voices; *ip != 255; ip = next_ip) {
-                Voice* v = &player->voices[*ip];
-                next_ip = &v->next;
-                goto skip_delete_voice;
-                delete_voice: {
-                    next_ip = ip;
-                    *ip = v->next;
-                    v->next = player->inactive;
-                    player->inactive = v - player->voices;
-                    player->n_active_voices -= 1;
-                    continue;
-                }
-                skip_delete_voice: { }
-                if (v->sample) {
-                    for (int i = 0; i < chunk_length; i++) {
-                         // Update volume and pitch only every once in a while
-                        if (!--v->control_timer) {
-                            v->control_timer = CONTROL_UPDATE_INTERVAL;
-                             // Do envelopes  TODO: fade to 0 at end  TODO2: what did I mean when I wrote that
-                            if (v->do_envelope) {
-                                uint32_t rate = v->sample->envelope_rates[v->envelope_phase] * CONTROL_UPDATE_INTERVAL;
-                                uint32_t target = v->sample->envelope_offsets[v->envelope_phase];
-                                if (target > v->envelope_value) {  // Get louder
-                                    if (v->envelope_value + rate < target) {
-                                        v->envelope_value += rate;
-                                    }
-                                    else if (v->envelope_phase == 5) {
-                                        goto delete_voice;
-                                    }
-                                    else {
-                                        v->envelope_value = target;
-                                        if (v->envelope_phase != 2 || !v->sample->sustain) {
-                                            v->envelope_phase += 1;
-                                        }
-                                    }
-                                }
-                                else {  // Get quieter
-                                    if (target + rate < v->envelope_value) {
-                                        v->envelope_value -= rate;
-                                    }
-                                    else if (v->envelope_phase == 5 || target == 0) {
-                                        goto delete_voice;
-                                    }
-                                    else {
-                                        v->envelope_value = target;
-                                        if (v->envelope_phase != 2 || !v->sample->sustain) {
-                                            v->envelope_phase += 1;
-                                        }
-                                    }
-                                }
-                            }
-                            else { v->envelope_value = 0x3ff00000; }
-                             // Tremolo
-                            v->tremolo_sweep += v->sample->tremolo_sweep_inc * CONTROL_UPDATE_INTERVAL;
-                            if (v->tremolo_sweep > 0x1000000)
-                                v->tremolo_sweep = 0x1000000;
-                            v->tremolo_phase += v->sample->tremolo_phase_inc * CONTROL_UPDATE_INTERVAL;
-                            if (v->tremolo_phase >= 0x1000000)
-                                v->tremolo_phase -= 0x1000000;
-                            uint32_t tremolo = v->sample->tremolo_depth
-                                             * v->tremolo_sweep / (0x1000000 / 0x80)
-                                             * sines[v->tremolo_phase / (0x1000000 / SINES_SIZE)] / 0x8000;
-                             // Volume calculation.
-                            if (v->envelope_phase < 3) {
-                                v->channel_volume = (uint32_t)vols[ch->volume]
-                                                  * vols[ch->expression] / 0x10000;
-                            }
-                            v->volume = (uint32_t)v->patch_volume * 0x100
-                                      * v->channel_volume / 0x10000
-                                      * vols[v->velocity] / 0x10000
-                                      * envs[v->envelope_value / 0x100000] / 0x10000
-                                      * (0x10000 + tremolo) / 0x10000;
-                             // Vibrato
-                            v->vibrato_sweep += v->sample->vibrato_sweep_inc * CONTROL_UPDATE_INTERVAL;
-                            if (v->vibrato_sweep > 0x1000000)
-                                v->vibrato_sweep = 0x1000000;
-                            v->vibrato_phase += v->sample->vibrato_phase_inc * CONTROL_UPDATE_INTERVAL;
-                            if (v->vibrato_phase >= 0x1000000)
-                                v->vibrato_phase -= 0x1000000;
-                            uint32_t vibrato = v->sample->vibrato_depth
-                                             * v->vibrato_sweep / (0x1000000 / 0x80)
-                                             * sines[v->vibrato_phase / (0x1000000 / SINES_SIZE)] / 0x8000;
-                             // Notes are on a logarithmic scale, so we add instead of multiplying
-                            uint32_t note = (int64_t)v->note * 0x10000
-                                          + (int64_t)ch->pitch_bend * ch->pitch_bend_sensitivity / 0x2000
-                                          + vibrato * 4;  // Range over a whole step
-                            v->sample_inc = v->sample->sample_inc
-                                          * get_freq(note) / v->sample->root_freq;
-                        }
-
-                         // Linear interpolation.
-                        uint32_t high = v->sample_pos / 0x100000000LL;
-                        uint64_t low = v->sample_pos % 0x100000000LL;
-                        int64_t samp = v->sample->data[high] * (0x100000000LL - low)
-                                     + v->sample->data[high + 1] * low;
-                         // Write!
-                        uint64_t val = samp / 0x100000000LL * v->volume / 0x10000;
-                        chunk[i][0] += val * (64 + ch->pan) / 64;
-                        chunk[i][1] += val * (64 - ch->pan) / 64;
-                         // Move sample position forward (or backward)
-                         // TODO: go all the way to sample end if no loop
-                        if (v->backwards) {
-                            v->sample_pos -= v->sample_inc;
-                            if (v->sample_pos < v->sample->loop_start) {
-                                if (v->do_loop) {
-                                     // pingpong assumed
-                                    v->backwards = 0;
-                                    v->sample_pos = 2 * v->sample->loop_start - v->sample_pos;
-                                }
-                                else goto delete_voice;
-                            }
-                        }
-                        else {
-                            v->sample_pos += v->sample_inc;
-                            if (v->sample_pos >= v->sample->loop_end) {
-                                if (v->do_loop) {
-                                    if (v->sample->pingpong) {
-                                        v->backwards = 1;
-                                        v->sample_pos = 2 * v->sample->loop_end - v->sample_pos;
-                                    }
-                                    else {
-                                        v->sample_pos -= v->sample->loop_end - v->sample->loop_start;
-                                    }
-                                }
-                                else goto delete_voice;
-                            }
-                        }
-                    }
+        int32_t(* chunk )[MAX_CHUNK_LENGTH][2] = player->chunks;
+        int32_t(* buses [MAX_BUSES])[2];
+        for (int b = 0; b < n_buses; b++) {
+            buses[b] = chunk[b];
+            if (mixing)
+                memset(chunk[b], 0, chunk_length * sizeof(chunk[b][0]));
+        }
+        Mix_Job job;
+        job.control_updates = 0;
+        job.control_ns = 0;
+        if (mixing && player->pool && player->n_active_voices * chunk_length >= MIN_THREADED_MIX) {
+            job.player = player;
+            job.start = player->sample;
+            job.chunk_length = chunk_length;
+            job.n_buses = n_buses;
+            job.buses = buses;
+            pool_run(player->pool, mix_job, &job);
+            for (int t = 1; t < player->pool->n_threads; t++)
+            for (int b = 0; b < n_buses; b++) {
+                int32_t(* partial )[2] = partial_bus(player, t, b);
+                for (int i = 0; i < chunk_length; i++) {
+                    chunk[b][i][0] += partial[i][0];
+                    chunk[b][i][1] += partial[i][1];
                 }
-                else if (!ch->is_drums) {  // No patch, do a square wave!
-                    if (v->envelope_phase >= 3)
-                        goto delete_voice;
-                    for (int i = 0; i < chunk_length; i++) {
-                         // Loop
-                        v->sample_pos %= 0x100000000LL;
-                         // Add value
-                        int32_t sign = v->sample_pos < 0x80000000LL ? -1 : 1;
-                        uint32_t val = sign * v->velocity * ch->volume * ch->expression / (32*127);
-                        chunk[i][0] += val;
-                        chunk[i][1] += val;
-                         // Move position
-                        uint32_t freq = get_freq(v->note << 8);
-                        v->sample_pos += 0x100000000LL * freq / 1000 / MDV_SAMPLE_RATE;
-                    }
+            }
+        }
+        else {
+            render_voices(player, 0, player->n_active_voices, player->sample,
+                mixing ? buses : NULL, chunk_length, job.alive,
+                &job.control_updates, &job.control_ns
+            );
+        }
+         // Finished voices are deleted the same way either way, so voice
+         //  allocation stays deterministic.
+        delete_voices(player, job.alive);
+        player->sample += chunk_length;
+         // Collect the sends, so the effects cost the same however many
+         //  voices there are.
+        uint64_t effects_start = 0;
+        if (sending) {
+            memset(sends, 0, sizeof(sends));
+            for (int j = 0; j < n_send_channels; j++) {
+                uint8_t c = send_channels[j];
+                int32_t(* src )[2] = chunk[player->channel_bus[c]];
+                int32_t(* dst )[2] = chunk[stem_bus[player->channel_stem[c]]];
+                float reverb = player->channels[c].reverb * (1.0f / 127);
+                float chorus = player->channels[c].chorus * (1.0f / 127);
+                for (int i = 0; i < chunk_length; i++) {
+                    float mono = src[i][0] + src[i][1];
+                    sends[0][i] += mono * reverb;
+                    sends[1][i] += mono * chorus;
+                    dst[i][0] += src[i][0];
+                    dst[i][1] += src[i][1];
                 }
             }
+            effects_start = counter_clock();
+            if (out->dry) {
+                memcpy(out->sends[0] + buf_pos, sends[0], chunk_length * sizeof(float));
+                memcpy(out->sends[1] + buf_pos, sends[1], chunk_length * sizeof(float));
+            }
+            else effects_run(player->effects, sends[0], sends[1], chunk_length, chunk[0]);
+        }
+        uint64_t output_start = counter_clock();
+        if (!sending)
+            effects_start = output_start;
+         // Finally write the chunk to the buffers.  Clipping is tallied
+         //  per chunk, in locals the loop can keep in registers.
+        uint32_t clipped = 0;
+        uint32_t peak = 0;
+        for (int b = 1; mixing && b < n_stem_buses; b++) {
+            for (int i = 0; i < chunk_length; i++) {
+                int16_t* o = bus_out[b][buf_pos + i];
+                o[0] = clip(chunk[b][i][0]);
+                o[1] = clip(chunk[b][i][1]);
+            }
+        }
+        for (int i = 0; mixing && (out->master || out->dry) && i < chunk_length; i++) {
+            int32_t l = chunk[0][i][0];
+            int32_t r = chunk[0][i][1];
+            for (int b = 1; b < n_stem_buses; b++) {
+                l += chunk[b][i][0];
+                r += chunk[b][i][1];
+            }
+            if (out->dry) {
+                out->dry[buf_pos + i][0] = l;
+                out->dry[buf_pos + i][1] = r;
+                continue;
+            }
+            int16_t* o = out->master[buf_pos + i];
+            o[0] = clip(l);
+            o[1] = clip(r);
+            if (COUNTERS) {
+                clipped += (uint32_t)l + 32768 > 0xffff;
+                clipped += (uint32_t)r + 32768 > 0xffff;
+                uint32_t al = l < 0 ? -(uint32_t)l : (uint32_t)l;
+                uint32_t ar = r < 0 ? -(uint32_t)r : (uint32_t)r;
+                peak = al > peak ? al : peak;
+                peak = ar > peak ? ar : peak;
+            }
+        }
+        if (COUNTERS) {
+            MDV_Counters* c = &player->counters;
+            uint64_t mix_ns = effects_start - mix_start;
+             // The control estimate can overshoot on short chunks
+            uint64_t control_ns = job.control_ns < mix_ns ? job.control_ns : mix_ns;
+            c->stage_ns[MDV_STAGE_EVENTS] += mix_start - events_start;
+            c->stage_ns[MDV_STAGE_CONTROL] += control_ns;
+            c->stage_ns[MDV_STAGE_MIX] += mix_ns - control_ns;
+            c->stage_ns[MDV_STAGE_EFFECTS] += output_start - effects_start;
+            c->stage_ns[MDV_STAGE_OUTPUT] += counter_clock() - output_start;
+            c->blocks += 1;
+            if (mixing)
+                c->voice_samples += (uint64_t)n_active_voices * chunk_length;
+            c->control_updates += job.control_updates;
+            if (n_active_voices > c->max_active_voices)
+                c->max_active_voices = n_active_voices;
+            c->clipped_samples += clipped;
+            if (peak > c->peak)
+                c->peak = peak;
+        }
+        buf_pos += chunk_length;
+        if (played == len && !mdv_currently_playing(player))
+            played = buf_pos;
+    }
+    if (player->queue)
+        __atomic_store_n(&player->queue->clock, player->sample, __ATOMIC_RELEASE);
+    return played;
+}
+
+void mdv_get_audio (MDV_Player* player, uint8_t* buf, int len) {
+    Audio_Out out = {(int16_t(*)[2])buf, NULL, 0, NULL, {NULL, NULL}};
+    get_audio(player, &out, len / 4);  // Assuming always a whole number of samples
+}
+
+void mdv_get_stem_audio (MDV_Player* player, uint8_t* master, uint8_t** stems, int n_stems, int len) {
+    Audio_Out out = {(int16_t(*)[2])master, (int16_t(**)[2])stems, n_stems, NULL, {NULL, NULL}};
+    get_audio(player, &out, len / 4);
+}
+
+ // Offline rendering cuts the song into segments of this many seconds.  A
+ //  pass that mixes nothing (which costs a fraction of a real render)
+ //  snapshots the entire player at the start of each segment, including
+ //  controllers, tempo, and any voices still ringing.  Thread 0 runs that
+ //  pass, and the other threads render segments from their snapshots as soon
+ //  as they're available.  The effects depend on everything before them, so
+ //  they're left out of that, and whichever thread renders the next segment
+ //  in line runs them over it.  Since the output doesn't depend on where
+ //  rendering stops and starts, this is identical to rendering straight
+ //  through.
+#define SEGMENT_SECONDS 1
+
+typedef struct Render_Segment {
+    MDV_Player* snapshot;
+    uint32_t length;
+    int16_t(* out )[2];
+     // Between rendering and finishing
+    int rendered;
+    int32_t(* dry )[2];
+    float* sends [2];
+} Render_Segment;
+
+typedef struct Render_Job {
+    MDV_Player* player;
+    uint32_t segment_length;  // In frames at the player's rate
+    Effects* effects;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    int finished;
+    uint32_t next_segment;
+    uint32_t n_segments;
+    uint32_t max_segments;
+    Render_Segment* segments;
+     // Segments are finished in order, by one thread at a time
+    int finishing;
+    uint32_t next_finish;
+} Render_Job;
+
+ // The rest of get_audio: effects and clipping
+static void finish_segment (Effects* effects, Render_Segment* seg) {
+    if (effects)
+        effects_run(effects, seg->sends[0], seg->sends[1], seg->length, seg->dry);
+    for (uint32_t i = 0; i < seg->length; i++) {
+        seg->out[i][0] = clip(seg->dry[i][0]);
+        seg->out[i][1] = clip(seg->dry[i][1]);
+    }
+    free(seg->dry);
+    free(seg->sends[0]);
+    free(seg->sends[1]);
+}
+
+static void render_job (void* job_, int worker) {
+    Render_Job* job = (Render_Job*)job_;
+    if (worker == 0) {
+        Render_Segment seg;
+        do {
+            seg.snapshot = malloc(sizeof(MDV_Player));
+            *seg.snapshot = *job->player;
+            seg.length = get_audio(job->player, NULL, job->segment_length);
+            seg.out = malloc(seg.length * sizeof(*seg.out));
+            seg.rendered = 0;
+            pthread_mutex_lock(&job->mutex);
+            if (job->n_segments >= job->max_segments) {
+                job->max_segments *= 2;
+                job->segments = realloc(job->segments, job->max_segments * sizeof(Render_Segment));
+            }
+            job->segments[job->n_segments++] = seg;
+            pthread_cond_broadcast(&job->ready);
+            pthread_mutex_unlock(&job->mutex);
+        } while (seg.length == job->segment_length);
+        pthread_mutex_lock(&job->mutex);
+        job->finished = 1;
+        pthread_cond_broadcast(&job->ready);
+        pthread_mutex_unlock(&job->mutex);
+    }
+     // The snapshots all share the sequencing pass's buses, so mix in this
+     //  thread's own
+    int32_t(* chunks )[MAX_CHUNK_LENGTH][2] = alloc_chunks();
+    for (;;) {
+        pthread_mutex_lock(&job->mutex);
+        while (job->next_segment == job->n_segments && !job->finished)
+            pthread_cond_wait(&job->ready, &job->mutex);
+        if (job->next_segment == job->n_segments) {
+            pthread_mutex_unlock(&job->mutex);
+            break;
+        }
+        uint32_t index = job->next_segment++;
+        Render_Segment seg = job->segments[index];
+        pthread_mutex_unlock(&job->mutex);
+         // The whole segment before effects, allocated here so only the
+         //  segments in flight need one
+        Audio_Out out = {NULL, NULL, 0, NULL, {NULL, NULL}};
+        out.dry = malloc(seg.length * sizeof(*out.dry));
+        if (job->effects) {
+            out.sends[0] = malloc(seg.length * sizeof(float));
+            out.sends[1] = malloc(seg.length * sizeof(float));
         }
-         // Finally write the chunk to buffer
-        for (int i = 0; i < chunk_length; i++) {
-            buf[buf_pos][0] = chunk[i][0] > 32767 ? 32767 : chunk[i][0] < -32768 ? -32768 : chunk[i][0];
-            buf[buf_pos][1] = chunk[i][1] > 32767 ? 32767 : chunk[i][1] < -32768 ? -32768 : chunk[i][1];
-             // debug clip count
-            if (buf[buf_pos][0] == 32767 || buf[buf_pos][0] == -32768)
-                player->clip_count += 1;
-            if (buf[buf_pos][1] == 32767 || buf[buf_pos][1] == -32768)
-                player->clip_count += 1;
-            if (chunk[i][0] > player->max_value)
-                player->max_value = chunk[i][0];
-            else if (-chunk[i][0] > player->max_value)
-                player->max_value = -chunk[i][0];
-            if (chunk[i][1] > player->max_value)
-                player->max_value = chunk[i][1];
-            else if (-chunk[i][1] > player->max_value)
-                player->max_value = -chunk[i][1];
-            buf_pos += 1;
+        seg.snapshot->chunks = chunks;
+        get_audio(seg.snapshot, &out, seg.length);
+        free(seg.snapshot);
+        pthread_mutex_lock(&job->mutex);
+        Render_Segment* done = &job->segments[index];
+        done->dry = out.dry;
+        done->sends[0] = out.sends[0];
+        done->sends[1] = out.sends[1];
+        done->rendered = 1;
+        while (!job->finishing && job->next_finish < job->n_segments
+            && job->segments[job->next_finish].rendered
+        ) {
+            job->finishing = 1;
+            Render_Segment next = job->segments[job->next_finish];
+            pthread_mutex_unlock(&job->mutex);
+            finish_segment(job->effects, &next);
+            pthread_mutex_lock(&job->mutex);
+            job->finishing = 0;
+            job->next_finish++;
         }
+        pthread_mutex_unlock(&job->mutex);
     }
+    free(chunks);
 }
 
+uint8_t* mdv_render_sequence (MDV_Player* player, MDV_Sequence* seq, int n_threads, size_t* len) {
+     // Work on a copy so the player itself isn't disturbed.  The copies share
+     //  patches with the original, which is fine since nothing writes to them.
+    Render_Job job;
+    job.player = malloc(sizeof(MDV_Player));
+    *job.player = *player;
+    job.player->pool = NULL;
+    job.player->chunks = alloc_chunks();
+    job.player->partial_chunks = NULL;
+    job.player->checkpoints = NULL;
+    job.player->effects = NULL;
+    job.player->queue = NULL;
+    job.segment_length = player->sample_rate * SEGMENT_SECONDS;
+    mdv_play_sequence(job.player, seq);
+     // Starting from silence, like the copy
+    job.effects = player->effects ? effects_new(player->sample_rate) : NULL;
+     // Don't drop notes whose patches are still loading
+    if (player->library)
+        mdv_wait_patch_library(player->library);
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.ready, NULL);
+    job.finished = 0;
+    job.next_segment = 0;
+    job.n_segments = 0;
+    job.max_segments = 64;
+    job.segments = malloc(job.max_segments * sizeof(Render_Segment));
+    job.finishing = 0;
+    job.next_finish = 0;
+    if (n_threads > 1) {
+        Thread_Pool* pool = pool_new(n_threads);
+        pool_run(pool, render_job, &job);
+        pool_free(pool);
+    }
+    else render_job(&job, 0);
+    pthread_cond_destroy(&job.ready);
+    pthread_mutex_destroy(&job.mutex);
+    free(job.player->chunks);
+    free(job.player);
+    effects_free(job.effects);
+     // Stitch the segments together
+    size_t frames = (size_t)(job.n_segments - 1) * job.segment_length
+                  + job.segments[job.n_segments - 1].length;
+    int16_t(* out )[2] = malloc(frames * sizeof(*out));
+    for (uint32_t i = 0; i < job.n_segments; i++) {
+        memcpy(out + (size_t)i * job.segment_length, job.segments[i].out,
+            job.segments[i].length * sizeof(*out)
+        );
+        free(job.segments[i].out);
+    }
+    free(job.segments);
+    *len = frames * sizeof(*out);
+    return (uint8_t*)out;
+}
@@ -0,0 +1,265 @@
+ // Reverb and chorus.  Each takes a mono send and returns stereo, and works
+ //  on whole blocks at a time in aligned buffers, so its cost only depends
+ //  on how many frames there are, not on what's playing.
+ //
+ // The reverb is a feedback delay network: eight delay lines whose outputs
+ //  are damped, mixed by a Hadamard matrix, and fed back in with the send.
+ //  No line is shorter than a block, so a block of every line's output can
+ //  be read before any of it is written.  Then the matrix and the feedback
+ //  work across a block of frames at a time, which GCC vectorizes.
+ //
+ // The chorus is one delay line read at two points, one for each side,
+ //  swept by a slow LFO a quarter cycle apart.
+ //
+ // Every frame is computed the same way no matter how the frames are split
+ //  into blocks, so the output doesn't depend on block sizes.
+
+#define REVERB_LINES 8
+#define EFFECT_BLOCK 256
+#define REVERB_TIME 2.0  // Seconds to fall by 60 dB
+#define REVERB_DAMP_FREQ 6000.0
+#define REVERB_IN 0.5f
+#define REVERB_OUT 0.125f
+#define CHORUS_DELAY 0.012  // Seconds
+#define CHORUS_DEPTH 0.003
+#define CHORUS_FREQ 0.8
+#define CHORUS_IN 0.5f
+#define CHORUS_OUT 0.25f
+ // How long after the sends go quiet the effects can be, too
+#define EFFECT_TAIL 4
+
+ // Line lengths at 48 kHz, all prime so their echoes don't line up
+static const uint32_t reverb_lengths [REVERB_LINES] = {
+    1031, 1327, 1523, 1871, 2053, 2311, 2591, 2887
+};
+
+typedef struct Effects {
+     // Rows are padded so they aren't a multiple of 4K apart, which would
+     //  make loads from one wait on stores to another.
+    float work [REVERB_LINES][EFFECT_BLOCK + 16];
+    float out [2][EFFECT_BLOCK];
+     // Frames since the last nonzero send.  When this reaches tail, the
+     //  effects are cleared and skipped until a send comes in.
+    uint32_t tail;
+    uint32_t quiet;
+    int idle;
+     // Reverb
+    uint32_t reverb_size;  // Of each line, a power of 2
+    uint32_t reverb_stride;  // From one line to the next
+    uint32_t reverb_pos;
+    uint32_t reverb_block;  // Never longer than the shortest line
+    uint32_t reverb_len [REVERB_LINES];
+    float reverb_gain [REVERB_LINES];
+    float reverb_damp;
+    float reverb_lp [REVERB_LINES];
+    float* reverb_lines;
+     // Chorus
+    uint32_t chorus_size;
+    uint32_t chorus_pos;
+    uint32_t chorus_phase;  // 0:32
+    uint32_t chorus_inc;
+    float chorus_delay;  // In frames
+    float chorus_depth;
+    float* chorus_line;
+} Effects;
+
+static void* effects_alloc (size_t size) {
+    void* p;
+    if (posix_memalign(&p, 64, size) != 0) {
+        fprintf(stderr, "Could not allocate effects\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint32_t pow2_at_least (uint32_t n) {
+    uint32_t r = 1;
+    while (r < n) r *= 2;
+    return r;
+}
+
+ // Back to silence
+static void effects_clear (Effects* e) {
+    memset(e->reverb_lines, 0, REVERB_LINES * e->reverb_stride * sizeof(float));
+    memset(e->chorus_line, 0, e->chorus_size * sizeof(float));
+    memset(e->reverb_lp, 0, sizeof(e->reverb_lp));
+    e->reverb_pos = 0;
+    e->chorus_pos = 0;
+    e->chorus_phase = 0;
+    e->quiet = 0;
+    e->idle = 1;
+}
+
+static Effects* effects_new (uint32_t rate) {
+    Effects* e = effects_alloc(sizeof(Effects));
+    e->tail = EFFECT_TAIL * rate;
+    uint32_t longest = 0;
+    e->reverb_block = EFFECT_BLOCK;
+    for (int k = 0; k < REVERB_LINES; k++) {
+        uint32_t len = (uint64_t)reverb_lengths[k] * rate / 48000;
+        e->reverb_len[k] = len;
+        if (len > longest) longest = len;
+        if (len < e->reverb_block) e->reverb_block = len;
+         // The Hadamard matrix isn't normalized, so that goes in here
+        e->reverb_gain[k] = pow(10, -3.0 * len / (rate * REVERB_TIME)) / sqrt(REVERB_LINES);
+    }
+    e->reverb_damp = 1 - exp(-2 * PI * REVERB_DAMP_FREQ / rate);
+    e->reverb_size = pow2_at_least(longest + EFFECT_BLOCK + 1);
+    e->reverb_stride = e->reverb_size + 16;  // Same as work
+    e->reverb_lines = effects_alloc(REVERB_LINES * e->reverb_stride * sizeof(float));
+    e->chorus_delay = CHORUS_DELAY * rate;
+    e->chorus_depth = CHORUS_DEPTH * rate;
+    e->chorus_inc = CHORUS_FREQ * 4294967296.0 / rate;
+    e->chorus_size = pow2_at_least(e->chorus_delay + e->chorus_depth + EFFECT_BLOCK + 2);
+    e->chorus_line = effects_alloc(e->chorus_size * sizeof(float));
+    effects_clear(e);
+    return e;
+}
+
+static void effects_free (Effects* e) {
+    if (!e) return;
+    free(e->reverb_lines);
+    free(e->chorus_line);
+    free(e);
+}
+
+ // Copy n frames between a delay line and a block, in up to two pieces if
+ //  the line wraps around
+static void line_read (const float* line, uint32_t size, uint32_t from, float* to, int n) {
+    uint32_t first = size - from < (uint32_t)n ? size - from : (uint32_t)n;
+    memcpy(to, line + from, first * sizeof(float));
+    memcpy(to + first, line, (n - first) * sizeof(float));
+}
+static void line_write (float* line, uint32_t size, uint32_t to, const float* from, int n) {
+    uint32_t first = size - to < (uint32_t)n ? size - to : (uint32_t)n;
+    memcpy(line + to, from, first * sizeof(float));
+    memcpy(line, from + first, (n - first) * sizeof(float));
+}
+
+ // Run n frames (at most reverb_block) of the reverb, adding to e->out
+ //  starting at frame at
+static void reverb_block (Effects* e, const float* in, int at, int n) {
+    uint32_t mask = e->reverb_size - 1;
+    for (int k = 0; k < REVERB_LINES; k++) {
+        line_read(e->reverb_lines + k * e->reverb_stride, e->reverb_size,
+            (e->reverb_pos - e->reverb_len[k]) & mask, e->work[k], n
+        );
+    }
+     // One-pole lowpass, so highs die away faster.  All the lines go at
+     //  once so their recurrences overlap.
+    float lp [REVERB_LINES];
+    memcpy(lp, e->reverb_lp, sizeof(lp));
+    float damp = e->reverb_damp;
+    for (int i = 0; i < n; i++)
+    for (int k = 0; k < REVERB_LINES; k++) {
+        lp[k] += damp * (e->work[k][i] - lp[k]);
+        e->work[k][i] = lp[k];
+    }
+    memcpy(e->reverb_lp, lp, sizeof(lp));
+     // Output taps, then a fast Hadamard transform across the lines, then
+     //  feedback, for a vector of frames at a time.
+    float (* w )[EFFECT_BLOCK + 16] = e->work;
+    float g0 = e->reverb_gain[0], g1 = e->reverb_gain[1];
+    float g2 = e->reverb_gain[2], g3 = e->reverb_gain[3];
+    float g4 = e->reverb_gain[4], g5 = e->reverb_gain[5];
+    float g6 = e->reverb_gain[6], g7 = e->reverb_gain[7];
+    for (int i = 0; i < n; i++) {
+        float y0 = w[0][i], y1 = w[1][i], y2 = w[2][i], y3 = w[3][i];
+        float y4 = w[4][i], y5 = w[5][i], y6 = w[6][i], y7 = w[7][i];
+        e->out[0][at + i] += REVERB_OUT * ((y0 + y2) + (y4 + y6));
+        e->out[1][at + i] += REVERB_OUT * ((y1 + y3) + (y5 + y7));
+        float a0 = y0 + y1, a1 = y0 - y1, a2 = y2 + y3, a3 = y2 - y3;
+        float a4 = y4 + y5, a5 = y4 - y5, a6 = y6 + y7, a7 = y6 - y7;
+        float b0 = a0 + a2, b2 = a0 - a2, b1 = a1 + a3, b3 = a1 - a3;
+        float b4 = a4 + a6, b6 = a4 - a6, b5 = a5 + a7, b7 = a5 - a7;
+        float x = in[at + i] * REVERB_IN;
+        w[0][i] = (b0 + b4) * g0 + x;
+        w[1][i] = (b1 + b5) * g1 - x;
+        w[2][i] = (b2 + b6) * g2 + x;
+        w[3][i] = (b3 + b7) * g3 - x;
+        w[4][i] = (b0 - b4) * g4 + x;
+        w[5][i] = (b1 - b5) * g5 - x;
+        w[6][i] = (b2 - b6) * g6 + x;
+        w[7][i] = (b3 - b7) * g7 - x;
+    }
+    for (int k = 0; k < REVERB_LINES; k++) {
+        line_write(e->reverb_lines + k * e->reverb_stride, e->reverb_size,
+            e->reverb_pos & mask, w[k], n
+        );
+    }
+    e->reverb_pos += n;
+}
+
+ // Run n frames (at most EFFECT_BLOCK) of the chorus, adding to e->out
+static void chorus_block (Effects* e, const float* in, int n) {
+    uint32_t mask = e->chorus_size - 1;
+     // The shortest delay is longer than a frame, so the whole block can be
+     //  written before reading any of it.
+    for (int i = 0; i < n; i++)
+        e->chorus_line[(e->chorus_pos + i) & mask] = in[i] * CHORUS_IN;
+    for (int s = 0; s < 2; s++) {
+        uint32_t phase = e->chorus_phase + s * 0x40000000U;
+        for (int i = 0; i < n; i++) {
+            float sweep = sines[(phase + i * e->chorus_inc) / (0x100000000ULL / SINES_SIZE)] * (1.0f / 0x7fff);
+            float delay = e->chorus_delay + e->chorus_depth * sweep;
+            int32_t whole = delay;
+            float frac = delay - whole;
+            uint32_t at = e->chorus_pos + i - whole;
+            float a = e->chorus_line[at & mask];
+            float b = e->chorus_line[(at - 1) & mask];
+            e->out[s][i] += CHORUS_OUT * (a + (b - a) * frac);
+        }
+    }
+    e->chorus_pos += n;
+    e->chorus_phase += n * e->chorus_inc;
+}
+
+ // Run up to EFFECT_BLOCK frames through both effects
+static void effects_block (Effects* e, const float* reverb_in, const float* chorus_in, int n) {
+    for (int i = 0; i < n; i++) {
+        e->out[0][i] = 0;
+        e->out[1][i] = 0;
+    }
+    for (int i = 0; i < n; i += e->reverb_block) {
+        int m = n - i < (int)e->reverb_block ? n - i : (int)e->reverb_block;
+        reverb_block(e, reverb_in, i, m);
+    }
+    chorus_block(e, chorus_in, n);
+}
+
+ // Process n frames of sends, adding the effects' output to out.  Frames
+ //  before the sends first come in, and after the tail has died out, are
+ //  skipped.
+static void effects_run (
+    Effects* e, const float* reverb_in, const float* chorus_in,
+    int n, int32_t(* out )[2]
+) {
+    int i = 0;
+    while (i < n) {
+        if (e->idle) {
+            while (i < n && reverb_in[i] == 0 && chorus_in[i] == 0)
+                i++;
+            if (i == n) break;
+            e->idle = 0;
+            e->quiet = 0;
+        }
+         // Run up to a block, stopping early if the tail ends
+        int end = i;
+        int done = 0;
+        while (end < n && end - i < EFFECT_BLOCK && !done) {
+            if (reverb_in[end] != 0 || chorus_in[end] != 0)
+                e->quiet = 0;
+            else if (++e->quiet >= e->tail)
+                done = 1;
+            end++;
+        }
+        effects_block(e, reverb_in + i, chorus_in + i, end - i);
+        for (int j = 0; j < end - i; j++) {
+            out[i + j][0] += (int32_t)e->out[0][j];
+            out[i + j][1] += (int32_t)e->out[1][j];
+        }
+        if (done)
+            effects_clear(e);
+        i = end;
+    }
+}
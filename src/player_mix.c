@@ -0,0 +1,432 @@
+
+ // Voice mixing kernels.  A kernel renders a run of frames of one voice into
+ //  a chunk, starting at pos and stepping by inc, with inc changing by
+ //  inc_step and volume by volume_step every frame.  The caller guarantees
+ //  that no loop boundary or control update happens inside the run.
+ //
+ // There's a set of kernels for each interpolation mode.  Linear works from
+ //  the two nearest frames.  Cubic and sinc take a row of taps from the
+ //  polyphase tables in player_tables.c and sum them pairwise, the same way
+ //  in every kernel of the set.  Their vector kernels load each frame's taps
+ //  as whole vectors, then transpose four frames at a time to finish the
+ //  sums, so there are no gathers.
+ //
+ // All kernels use the same single-precision math in the same order, so they
+ //  produce identical output to each other.  They truncate at the same three
+ //  stages the old 64-bit integer path did (interpolation, volume, pan), so
+ //  they match it exactly except when a float product lands within rounding
+ //  error of an integer.  That happens for well under 0.1% of frames, and
+ //  then a voice is off by at most ±4 per channel.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MIX_X86 1
+#include <immintrin.h>
+#else
+#define MIX_X86 0
+#endif
+
+#include <string.h>
+
+typedef void Mix_Run (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+);
+
+ // The fractional position keeps 24 bits, which is all a float can take.
+#define MIX_FRAC_SCALE (1.0f / 0x1000000)
+
+static inline void mix_out (
+    float samp, float volume, float pan_l, float pan_r, int32_t* out
+) {
+    int32_t val = (float)(int32_t)samp * volume;
+     // val * pan is exact in a float, and the shift rounds down like before
+    out[0] += (int32_t)((float)val * pan_l) >> 6;
+    out[1] += (int32_t)((float)val * pan_r) >> 6;
+}
+
+static inline void mix_frame (
+    const int16_t* data, int64_t pos,
+    float volume, float pan_l, float pan_r, int32_t* out
+) {
+    uint32_t high = pos >> 32;
+    float frac = (float)((uint32_t)pos >> 8) * MIX_FRAC_SCALE;
+    float a = data[high];
+    float b = data[high + 1];
+    mix_out(a + (b - a) * frac, volume, pan_l, pan_r, out);
+}
+
+ // Which row of taps to use, rounded to the nearest
+static inline uint32_t tap_phase (int64_t pos, uint32_t phases) {
+    return ((uint64_t)(uint32_t)pos + 0x80000000ULL / phases) / (0x100000000ULL / phases);
+}
+
+static inline float cubic_value (const int16_t* data, int64_t pos) {
+    const int16_t* d = data + (uint32_t)(pos >> 32) - 1;
+    const float* c = cubic_taps[tap_phase(pos, CUBIC_PHASES)];
+    float t [CUBIC_TAPS];
+    for (int j = 0; j < CUBIC_TAPS; j++)
+        t[j] = c[j] * (float)d[j];
+    return (t[0] + t[2]) + (t[1] + t[3]);
+}
+
+static inline float sinc_value (const int16_t* data, int64_t pos) {
+    const int16_t* d = data + (uint32_t)(pos >> 32) - (SINC_TAPS / 2 - 1);
+    const float* c = sinc_taps[tap_phase(pos, SINC_PHASES)];
+    float t [SINC_TAPS];
+    for (int j = 0; j < SINC_TAPS; j++)
+        t[j] = c[j] * (float)d[j];
+     // Halve the list until one is left, adding each tap to the one half
+     //  the list away.
+    for (int n = SINC_TAPS / 2; n >= 1; n /= 2)
+        for (int j = 0; j < n; j++)
+            t[j] = t[j] + t[j + n];
+    return t[0];
+}
+
+static void mix_run_c (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    for (int i = 0; i < n; i++) {
+        mix_frame(data, pos, volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+static void mix_run_cubic_c (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    for (int i = 0; i < n; i++) {
+        mix_out(cubic_value(data, pos), volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+static void mix_run_sinc_c (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    for (int i = 0; i < n; i++) {
+        mix_out(sinc_value(data, pos), volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+#if MIX_X86
+
+ // Apply volume and pan to four interpolated frames starting at frame i, and
+ //  add them to out.
+__attribute__((target("sse2")))
+static inline void mix_out_sse2 (
+    __m128 samp, int i, float volume, float volume_step,
+    float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    samp = _mm_cvtepi32_ps(_mm_cvttps_epi32(samp));
+    __m128 index = _mm_cvtepi32_ps(_mm_setr_epi32(i, i+1, i+2, i+3));
+    __m128 v = _mm_add_ps(_mm_set1_ps(volume), _mm_mul_ps(_mm_set1_ps(volume_step), index));
+    __m128 val = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(samp, v)));
+    __m128i l = _mm_srai_epi32(_mm_cvttps_epi32(_mm_mul_ps(val, _mm_set1_ps(pan_l))), 6);
+    __m128i r = _mm_srai_epi32(_mm_cvttps_epi32(_mm_mul_ps(val, _mm_set1_ps(pan_r))), 6);
+    __m128i* o = (__m128i*)out[i];
+    _mm_storeu_si128(o, _mm_add_epi32(_mm_loadu_si128(o), _mm_unpacklo_epi32(l, r)));
+    _mm_storeu_si128(o+1, _mm_add_epi32(_mm_loadu_si128(o+1), _mm_unpackhi_epi32(l, r)));
+}
+
+ // Four int16s, sign-extended to floats
+__attribute__((target("sse2")))
+static inline __m128 widen_lo_sse2 (__m128i w) {
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(w, w), 16));
+}
+__attribute__((target("sse2")))
+static inline __m128 widen_hi_sse2 (__m128i w) {
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(w, w), 16));
+}
+
+__attribute__((target("sse2")))
+static void mix_run_sse2 (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    __m128 scale = _mm_set1_ps(MIX_FRAC_SCALE);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+         // No gather in SSE2, so positions are stepped in scalar.  Each
+         //  32-bit load picks up both interpolation points at once.
+        int32_t pair [4];
+        int32_t frac [4];
+        for (int j = 0; j < 4; j++) {
+            memcpy(&pair[j], data + (uint32_t)(pos >> 32), 4);
+            frac[j] = (uint32_t)pos >> 8;
+            pos += inc;
+            inc += inc_step;
+        }
+        __m128i w = _mm_loadu_si128((__m128i*)pair);
+        __m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(w, 16), 16));
+        __m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(w, 16));
+        __m128 f = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((__m128i*)frac)), scale);
+        __m128 samp = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f));
+        mix_out_sse2(samp, i, volume, volume_step, pan_l, pan_r, out);
+    }
+    for (; i < n; i++) {
+        mix_frame(data, pos, volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+__attribute__((target("sse2")))
+static void mix_run_cubic_sse2 (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 t [4];
+        for (int j = 0; j < 4; j++) {
+            const int16_t* d = data + (uint32_t)(pos >> 32) - 1;
+            const float* c = cubic_taps[tap_phase(pos, CUBIC_PHASES)];
+            t[j] = _mm_mul_ps(_mm_load_ps(c), widen_lo_sse2(_mm_loadl_epi64((const __m128i*)d)));
+            pos += inc;
+            inc += inc_step;
+        }
+        _MM_TRANSPOSE4_PS(t[0], t[1], t[2], t[3]);
+        __m128 samp = _mm_add_ps(_mm_add_ps(t[0], t[2]), _mm_add_ps(t[1], t[3]));
+        mix_out_sse2(samp, i, volume, volume_step, pan_l, pan_r, out);
+    }
+    for (; i < n; i++) {
+        mix_out(cubic_value(data, pos), volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+__attribute__((target("sse2")))
+static void mix_run_sinc_sse2 (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 t [4];
+        for (int j = 0; j < 4; j++) {
+            const int16_t* d = data + (uint32_t)(pos >> 32) - (SINC_TAPS / 2 - 1);
+            const float* c = sinc_taps[tap_phase(pos, SINC_PHASES)];
+            __m128i w0 = _mm_loadu_si128((const __m128i*)d);
+            __m128i w1 = _mm_loadu_si128((const __m128i*)(d + 8));
+            __m128 q0 = _mm_mul_ps(_mm_load_ps(c), widen_lo_sse2(w0));
+            __m128 q1 = _mm_mul_ps(_mm_load_ps(c + 4), widen_hi_sse2(w0));
+            __m128 q2 = _mm_mul_ps(_mm_load_ps(c + 8), widen_lo_sse2(w1));
+            __m128 q3 = _mm_mul_ps(_mm_load_ps(c + 12), widen_hi_sse2(w1));
+            t[j] = _mm_add_ps(_mm_add_ps(q0, q2), _mm_add_ps(q1, q3));
+            pos += inc;
+            inc += inc_step;
+        }
+        _MM_TRANSPOSE4_PS(t[0], t[1], t[2], t[3]);
+        __m128 samp = _mm_add_ps(_mm_add_ps(t[0], t[2]), _mm_add_ps(t[1], t[3]));
+        mix_out_sse2(samp, i, volume, volume_step, pan_l, pan_r, out);
+    }
+    for (; i < n; i++) {
+        mix_out(sinc_value(data, pos), volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+ // Like mix_out_sse2, for eight frames
+__attribute__((target("avx2")))
+static inline void mix_out_avx2 (
+    __m256 samp, int i, float volume, float volume_step,
+    float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    samp = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(samp));
+    __m256 index = _mm256_cvtepi32_ps(_mm256_setr_epi32(i, i+1, i+2, i+3, i+4, i+5, i+6, i+7));
+    __m256 v = _mm256_add_ps(_mm256_set1_ps(volume), _mm256_mul_ps(_mm256_set1_ps(volume_step), index));
+    __m256 val = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_mul_ps(samp, v)));
+    __m256i l = _mm256_srai_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(val, _mm256_set1_ps(pan_l))), 6);
+    __m256i r = _mm256_srai_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(val, _mm256_set1_ps(pan_r))), 6);
+    __m256i lr_lo = _mm256_unpacklo_epi32(l, r);
+    __m256i lr_hi = _mm256_unpackhi_epi32(l, r);
+    __m256i* o = (__m256i*)out[i];
+    _mm256_storeu_si256(o, _mm256_add_epi32(_mm256_loadu_si256(o),
+        _mm256_permute2x128_si256(lr_lo, lr_hi, 0x20)
+    ));
+    _mm256_storeu_si256(o+1, _mm256_add_epi32(_mm256_loadu_si256(o+1),
+        _mm256_permute2x128_si256(lr_lo, lr_hi, 0x31)
+    ));
+}
+
+__attribute__((target("avx2")))
+static void mix_run_avx2 (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    int i = 0;
+    if (n >= 8) {
+        __m256 scale = _mm256_set1_ps(MIX_FRAC_SCALE);
+         // Positions and increments for 8 frames at a time, in two vectors
+         //  of 64-bit lanes each.  Over 8 frames a lane's position moves by
+         //  8 * inc + 28 * inc_step, and its increment by 8 * inc_step.
+        int64_t p [8];
+        int64_t d [8];
+        for (int j = 0; j < 8; j++) {
+            p[j] = pos + j * inc + inc_step * (j * (j - 1) / 2);
+            d[j] = inc + j * inc_step;
+        }
+        __m256i p0 = _mm256_loadu_si256((__m256i*)p);
+        __m256i p1 = _mm256_loadu_si256((__m256i*)(p + 4));
+        __m256i d0 = _mm256_loadu_si256((__m256i*)d);
+        __m256i d1 = _mm256_loadu_si256((__m256i*)(d + 4));
+        __m256i p_step = _mm256_set1_epi64x(28 * inc_step);
+        __m256i d_step = _mm256_set1_epi64x(8 * inc_step);
+        for (; i + 8 <= n; i += 8) {
+             // Split into high and low 32-bit lanes, back in frame order
+            __m256i hi = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(
+                _mm256_castsi256_ps(p0), _mm256_castsi256_ps(p1), _MM_SHUFFLE(3, 1, 3, 1)
+            )), _MM_SHUFFLE(3, 1, 2, 0));
+            __m256i lo = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(
+                _mm256_castsi256_ps(p0), _mm256_castsi256_ps(p1), _MM_SHUFFLE(2, 0, 2, 0)
+            )), _MM_SHUFFLE(3, 1, 2, 0));
+            p0 = _mm256_add_epi64(p0, _mm256_add_epi64(_mm256_slli_epi64(d0, 3), p_step));
+            p1 = _mm256_add_epi64(p1, _mm256_add_epi64(_mm256_slli_epi64(d1, 3), p_step));
+            d0 = _mm256_add_epi64(d0, d_step);
+            d1 = _mm256_add_epi64(d1, d_step);
+             // Gathering 32 bits at each index gets both interpolation points
+            __m256i w = _mm256_i32gather_epi32((const int*)data, hi, 2);
+            __m256 a = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(w, 16), 16));
+            __m256 b = _mm256_cvtepi32_ps(_mm256_srai_epi32(w, 16));
+            __m256 f = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(lo, 8)), scale);
+            __m256 samp = _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), f));
+            mix_out_avx2(samp, i, volume, volume_step, pan_l, pan_r, out);
+        }
+        pos += i * inc + inc_step * ((int64_t)i * (i - 1) / 2);
+        inc += i * inc_step;
+    }
+    for (; i < n; i++) {
+        mix_frame(data, pos, volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+__attribute__((target("avx2")))
+static void mix_run_cubic_avx2 (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const int16_t* d [8];
+        const float* c [8];
+        for (int j = 0; j < 8; j++) {
+            d[j] = data + (uint32_t)(pos >> 32) - 1;
+            c[j] = cubic_taps[tap_phase(pos, CUBIC_PHASES)];
+            pos += inc;
+            inc += inc_step;
+        }
+         // Frame j's taps in the low lane and j+4's in the high lane
+        __m256 t [4];
+        for (int j = 0; j < 4; j++) {
+            __m128i w = _mm_unpacklo_epi64(
+                _mm_loadl_epi64((const __m128i*)d[j]),
+                _mm_loadl_epi64((const __m128i*)d[j+4])
+            );
+            __m256 taps = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(c[j])), _mm_load_ps(c[j+4]), 1);
+            t[j] = _mm256_mul_ps(taps, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(w)));
+        }
+        __m256 a = _mm256_unpacklo_ps(t[0], t[1]);
+        __m256 b = _mm256_unpacklo_ps(t[2], t[3]);
+        __m256 e = _mm256_unpackhi_ps(t[0], t[1]);
+        __m256 f = _mm256_unpackhi_ps(t[2], t[3]);
+        __m256 r0 = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 r1 = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 r2 = _mm256_shuffle_ps(e, f, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 r3 = _mm256_shuffle_ps(e, f, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 samp = _mm256_add_ps(_mm256_add_ps(r0, r2), _mm256_add_ps(r1, r3));
+        mix_out_avx2(samp, i, volume, volume_step, pan_l, pan_r, out);
+    }
+    for (; i < n; i++) {
+        mix_out(cubic_value(data, pos), volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+__attribute__((target("avx2")))
+static void mix_run_sinc_avx2 (
+    const int16_t* data, int64_t pos, int64_t inc, int64_t inc_step, int n,
+    float volume, float volume_step, float pan_l, float pan_r, int32_t(* out )[2]
+) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+         // Each frame's taps, with the two halves already added
+        __m256 t [8];
+        for (int j = 0; j < 8; j++) {
+            const int16_t* d = data + (uint32_t)(pos >> 32) - (SINC_TAPS / 2 - 1);
+            const float* c = sinc_taps[tap_phase(pos, SINC_PHASES)];
+            __m256i w = _mm256_loadu_si256((const __m256i*)d);
+            __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(w)));
+            __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(w, 1)));
+            t[j] = _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(c), lo), _mm256_mul_ps(_mm256_load_ps(c + 8), hi));
+            pos += inc;
+            inc += inc_step;
+        }
+         // Add halves again, with frame j in the low lane and j+4 in the
+         //  high lane, then transpose within lanes to finish
+        __m256 u [4];
+        for (int j = 0; j < 4; j++) {
+            u[j] = _mm256_add_ps(
+                _mm256_permute2f128_ps(t[j], t[j+4], 0x20),
+                _mm256_permute2f128_ps(t[j], t[j+4], 0x31)
+            );
+        }
+        __m256 a = _mm256_unpacklo_ps(u[0], u[1]);
+        __m256 b = _mm256_unpacklo_ps(u[2], u[3]);
+        __m256 c = _mm256_unpackhi_ps(u[0], u[1]);
+        __m256 d = _mm256_unpackhi_ps(u[2], u[3]);
+        __m256 r0 = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 r1 = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 r2 = _mm256_shuffle_ps(c, d, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 r3 = _mm256_shuffle_ps(c, d, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 samp = _mm256_add_ps(_mm256_add_ps(r0, r2), _mm256_add_ps(r1, r3));
+        mix_out_avx2(samp, i, volume, volume_step, pan_l, pan_r, out);
+    }
+    for (; i < n; i++) {
+        mix_out(sinc_value(data, pos), volume + volume_step * (float)i, pan_l, pan_r, out[i]);
+        pos += inc;
+        inc += inc_step;
+    }
+}
+
+#endif
+
+static Mix_Run* select_mix_run (int interpolation) {
+#if MIX_X86
+    __builtin_cpu_init();
+    int avx2 = __builtin_cpu_supports("avx2");
+    int sse2 = __builtin_cpu_supports("sse2");
+    switch (interpolation) {
+        case MDV_CUBIC:
+            if (avx2) return mix_run_cubic_avx2;
+            if (sse2) return mix_run_cubic_sse2;
+            return mix_run_cubic_c;
+        case MDV_SINC:
+            if (avx2) return mix_run_sinc_avx2;
+            if (sse2) return mix_run_sinc_sse2;
+            return mix_run_sinc_c;
+        default:
+            if (avx2) return mix_run_avx2;
+            if (sse2) return mix_run_sse2;
+            return mix_run_c;
+    }
+#else
+    switch (interpolation) {
+        case MDV_CUBIC: return mix_run_cubic_c;
+        case MDV_SINC: return mix_run_sinc_c;
+        default: return mix_run_c;
+    }
+#endif
+}
@@ -1,5 +1,6 @@
 
 #include <math.h>
+#include <pthread.h>
 
  // In 16:16 Hz, between note 0 and note 12
 #define FREQS_SIZE 4096
@@ -41,13 +42,61 @@ static void init_envs () {
     }
 }
 
-static void init_tables () {
-    static int initted = 0;
-    if (!initted) {
-        initted = 1;
-        init_freqs();
-        init_vols();
-        init_sines();
-        init_envs();
+#define PI 3.14159265358979
+
+ // Polyphase interpolation tables: a row of taps for each fraction of a
+ //  frame, in steps of 1/PHASES, with one more row for a whole frame so the
+ //  phase can be rounded up into it.  Rows are aligned so they load as
+ //  whole vectors.
+#define CUBIC_TAPS 4
+#define CUBIC_PHASES 1024
+static float cubic_taps [CUBIC_PHASES + 1][CUBIC_TAPS] __attribute__((aligned(16)));
+ // Catmull-Rom spline through the frames at -1, 0, 1 and 2
+static void init_cubic () {
+    for (uint32_t i = 0; i <= CUBIC_PHASES; i++) {
+        double x = (double)i / CUBIC_PHASES;
+        cubic_taps[i][0] = (-x*x*x + 2*x*x - x) / 2;
+        cubic_taps[i][1] = (3*x*x*x - 5*x*x + 2) / 2;
+        cubic_taps[i][2] = (-3*x*x*x + 4*x*x + x) / 2;
+        cubic_taps[i][3] = (x*x*x - x*x) / 2;
+    }
+}
+
+ // Frames -7 through 8, so this fits in MDV_SAMPLE_GUARD
+#define SINC_TAPS 16
+#define SINC_PHASES 256
+static float sinc_taps [SINC_PHASES + 1][SINC_TAPS] __attribute__((aligned(64)));
+ // Blackman-windowed sinc, with each row scaled to unity gain at DC
+static void init_sinc () {
+    for (uint32_t i = 0; i <= SINC_PHASES; i++) {
+        double x = (double)i / SINC_PHASES;
+        double taps [SINC_TAPS];
+        double sum = 0;
+        for (int j = 0; j < SINC_TAPS; j++) {
+            double t = j - (SINC_TAPS / 2 - 1) - x;
+            double w = 0.42 + 0.5 * cos(PI * t / (SINC_TAPS / 2))
+                     + 0.08 * cos(2 * PI * t / (SINC_TAPS / 2));
+            taps[j] = (t == 0 ? 1 : sin(PI * t) / (PI * t)) * w;
+            sum += taps[j];
+        }
+        for (int j = 0; j < SINC_TAPS; j++) {
+            sinc_taps[i][j] = taps[j] / sum;
+        }
     }
 }
+
+static void init_all_tables () {
+    init_freqs();
+    init_vols();
+    init_sines();
+    init_envs();
+    init_cubic();
+    init_sinc();
+}
+
+ // Players can be made on any number of threads at once, and the first one
+ //  in fills the tables while the rest wait.
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static void init_tables () {
+    pthread_once(&tables_once, init_all_tables);
+}
@@ -0,0 +1,103 @@
+
+ // A minimal thread pool for splitting one job across a fixed set of threads.
+ //  The calling thread always takes part as worker 0, so a pool of n threads
+ //  only starts n-1 of its own.
+
+#include <pthread.h>
+
+typedef void Pool_Job (void* data, int worker);
+
+typedef struct Thread_Pool Thread_Pool;
+
+typedef struct Pool_Worker {
+    Thread_Pool* pool;
+    int index;
+    pthread_t thread;
+} Pool_Worker;
+
+struct Thread_Pool {
+    int n_threads;
+    Pool_Worker* workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+     // Bumped each time a job is posted, so workers can tell it's new
+    uint32_t generation;
+    int pending;
+    int quit;
+    Pool_Job* job;
+    void* job_data;
+};
+
+static void* pool_worker (void* w_) {
+    Pool_Worker* w = (Pool_Worker*)w_;
+    Thread_Pool* pool = w->pool;
+    uint32_t seen = 0;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->mutex);
+        pool->job(pool->job_data, w->index);
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+static Thread_Pool* pool_new (int n_threads) {
+    Thread_Pool* pool = malloc(sizeof(Thread_Pool));
+    pool->n_threads = n_threads;
+    pool->workers = malloc(n_threads * sizeof(Pool_Worker));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->quit = 0;
+    for (int i = 1; i < n_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_worker, &pool->workers[i]) != 0) {
+            fprintf(stderr, "Could not start mixing thread\n");
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+ // Run job on every thread in the pool and wait for all of them to finish.
+static void pool_run (Thread_Pool* pool, Pool_Job* job, void* data) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->job = job;
+    pool->job_data = data;
+    pool->pending = pool->n_threads - 1;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    job(data, 0);
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->pending)
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void pool_free (Thread_Pool* pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 1; i < pool->n_threads; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->workers);
+    free(pool);
+}